@@ -0,0 +1,180 @@
+// Compares the string hash implementations on map-key-sized strings and on
+// whole files. Build and run with `make bench-hash`, or pass your own files:
+//
+//   ./bench/hash_bench path/to/file ...
+//
+// With no arguments it uses the scripts and sources in this repository.
+
+#include <ctype.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+#define MAX_IMPLEMENTATIONS 8
+#define TARGET_BYTES (256u * 1024 * 1024)
+
+typedef struct {
+    const char** items;
+    int* lengths;
+    int count;
+    int capacity;
+    size_t totalBytes;
+} Corpus;
+
+static void addItem(Corpus* corpus, const char* item, int length) {
+    if (corpus->count == corpus->capacity) {
+        corpus->capacity = corpus->capacity < 64 ? 64 : corpus->capacity * 2;
+        corpus->items = realloc(corpus->items, sizeof(char*) * corpus->capacity);
+        corpus->lengths = realloc(corpus->lengths, sizeof(int) * corpus->capacity);
+        if (corpus->items == NULL || corpus->lengths == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+    corpus->items[corpus->count] = item;
+    corpus->lengths[corpus->count] = length;
+    corpus->count++;
+    corpus->totalBytes += (size_t)length;
+}
+
+static char* readWholeFile(const char* path, int* length) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char* buffer = malloc((size_t)size + 1);
+    if (buffer == NULL || fread(buffer, 1, (size_t)size, file) != (size_t)size) {
+        fclose(file);
+        free(buffer);
+        return NULL;
+    }
+    buffer[size] = '\0';
+    fclose(file);
+    *length = (int)size;
+    return buffer;
+}
+
+// Map keys are approximated by every identifier in the corpus files plus
+// the generated "key<n>" strings the example scripts use.
+static void addKeys(Corpus* keys, const char* text, int length) {
+    int i = 0;
+    while (i < length) {
+        if (isalpha((unsigned char)text[i]) || text[i] == '_') {
+            int start = i;
+            while (i < length &&
+                   (isalnum((unsigned char)text[i]) || text[i] == '_')) {
+                i++;
+            }
+            addItem(keys, text + start, i - start);
+        } else {
+            i++;
+        }
+    }
+}
+
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Hashes the corpus repeatedly and returns nanoseconds per byte.
+static double measure(HashFn hash, Corpus* corpus, uint32_t* checksum) {
+    int rounds = (int)(TARGET_BYTES / (corpus->totalBytes + 1)) + 1;
+    uint32_t sum = 0;
+
+    double start = nowSeconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < corpus->count; i++) {
+            sum += hash(corpus->items[i], corpus->lengths[i]);
+        }
+    }
+    double elapsed = nowSeconds() - start;
+
+    *checksum = sum;
+    return elapsed * 1e9 / ((double)corpus->totalBytes * rounds);
+}
+
+static void runSuite(const char* title, Corpus* corpus,
+                     HashImplementation* blocks, int blockCount) {
+    printf("\n%s: %d strings, %zu bytes, %.1f bytes on average\n", title,
+           corpus->count, corpus->totalBytes,
+           (double)corpus->totalBytes / corpus->count);
+    printf("  %-12s %10s %10s\n", "hash", "ns/byte", "GB/s");
+
+    uint32_t checksum;
+    double fnv = measure(hashFnv1a, corpus, &checksum);
+    printf("  %-12s %10.3f %10.2f\n", "fnv1a", fnv, 1.0 / fnv);
+
+    uint32_t reference = 0;
+    for (int i = 0; i < blockCount; i++) {
+        double ns = measure(blocks[i].function, corpus, &checksum);
+        printf("  %-12s %10.3f %10.2f\n", blocks[i].name, ns, 1.0 / ns);
+        if (i == 0) {
+            reference = checksum;
+        } else if (checksum != reference) {
+            printf("  ERROR: %s disagrees with %s\n", blocks[i].name,
+                   blocks[0].name);
+        }
+    }
+
+    double ns = measure(hashBytes, corpus, &checksum);
+    printf("  %-12s %10.3f %10.2f\n", "hashBytes", ns, 1.0 / ns);
+}
+
+int main(int argc, char* argv[]) {
+    Corpus files = {0};
+    Corpus keys = {0};
+
+    glob_t paths = {0};
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) glob(argv[i], i > 1 ? GLOB_APPEND : 0, NULL, &paths);
+    } else {
+        glob("std/*.fls", 0, NULL, &paths);
+        glob("examples/*/*.fls", GLOB_APPEND, NULL, &paths);
+        glob("src/*.c", GLOB_APPEND, NULL, &paths);
+        glob("include/*.h", GLOB_APPEND, NULL, &paths);
+    }
+
+    for (size_t i = 0; i < paths.gl_pathc; i++) {
+        int length;
+        char* contents = readWholeFile(paths.gl_pathv[i], &length);
+        if (contents == NULL) continue;
+        addItem(&files, contents, length);
+        addKeys(&keys, contents, length);
+    }
+    globfree(&paths);
+
+    static char generated[10000][16];
+    for (int i = 0; i < 10000; i++) {
+        int length = snprintf(generated[i], sizeof(generated[i]), "key%d", i);
+        addItem(&keys, generated[i], length);
+    }
+
+    if (files.count == 0) {
+        fprintf(stderr, "No input files; run from the repository root.\n");
+        return 1;
+    }
+
+    HashImplementation blocks[MAX_IMPLEMENTATIONS];
+    int blockCount = hashBlockImplementations(blocks, MAX_IMPLEMENTATIONS);
+    printf("Block hash used by the VM: %s (FNV-1a below %d bytes)\n",
+           blocks[blockCount - 1].name, HASH_BLOCK_MIN_LENGTH);
+
+    runSuite("Map keys", &keys, blocks, blockCount);
+    runSuite("File contents", &files, blocks, blockCount);
+
+    for (int i = 0; i < files.count; i++) free((char*)files.items[i]);
+    free(files.items);
+    free(files.lengths);
+    free(keys.items);
+    free(keys.lengths);
+    return 0;
+}
@@ -0,0 +1,175 @@
+// Counts which instructions the VM runs and which pairs of instructions
+// follow each other, to find sequences worth fusing into superinstructions.
+// Build and run with `make op-pairs`, or pass your own scripts:
+//
+//   ./bench/op_pairs [-n rows] path/to/script.fls ...
+//
+// With no arguments it runs the example scripts and std/*.fls. Each script
+// runs in a fresh VM with its input and output redirected to /dev/null.
+// Executed counts come from the dispatch loop; compiled counts are taken
+// from every chunk the compiler finishes, after its peephole pass.
+
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "debug.h"
+#include "vm.h"
+
+#define DEFAULT_ROWS 30
+#define PAIR_COUNT (UINT8_COUNT * UINT8_COUNT)
+
+static char* readWholeFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char* buffer = malloc((size_t)size + 1);
+    if (buffer == NULL || fread(buffer, 1, (size_t)size, file) != (size_t)size) {
+        fclose(file);
+        free(buffer);
+        return NULL;
+    }
+    buffer[size] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+// Runs one script with stdin, stdout and stderr pointing at /dev/null.
+static InterpretResult runQuietly(const char* path, const char* source) {
+    fflush(stdout);
+    fflush(stderr);
+    int saved[3];
+    int null = open("/dev/null", O_RDWR);
+    for (int fd = 0; fd < 3; fd++) {
+        saved[fd] = dup(fd);
+        dup2(null, fd);
+    }
+    close(null);
+
+    initVM();
+    // Compile every import, so its chunks are counted too.
+    vm.moduleCache = false;
+    InterpretResult result = interpret(path, source);
+    freeVM();
+
+    fflush(stdout);
+    fflush(stderr);
+    clearerr(stdin);
+    for (int fd = 0; fd < 3; fd++) {
+        dup2(saved[fd], fd);
+        close(saved[fd]);
+    }
+    return result;
+}
+
+static uint64_t* sortKeys;
+
+static int compareByCount(const void* a, const void* b) {
+    uint64_t x = sortKeys[*(const int*)a];
+    uint64_t y = sortKeys[*(const int*)b];
+    if (x != y) return x < y ? 1 : -1;
+    return *(const int*)a - *(const int*)b;
+}
+
+// Returns the indices of counts[0..count) from most to least frequent.
+static int* rank(uint64_t* counts, int count, uint64_t* total) {
+    int* order = malloc(sizeof(int) * count);
+    if (order == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    *total = 0;
+    for (int i = 0; i < count; i++) {
+        order[i] = i;
+        *total += counts[i];
+    }
+    sortKeys = counts;
+    qsort(order, count, sizeof(int), compareByCount);
+    return order;
+}
+
+static void printOps(const char* title, OpCounts* counts, int rows) {
+    uint64_t total;
+    int* order = rank(counts->ops, UINT8_COUNT, &total);
+    printf("\n%s: %llu instructions\n", title, (unsigned long long)total);
+    printf("  %14s %7s  %s\n", "count", "%", "instruction");
+    for (int i = 0; i < rows && i < UINT8_COUNT; i++) {
+        uint64_t count = counts->ops[order[i]];
+        if (count == 0) break;
+        printf("  %14llu %6.2f%%  %s\n", (unsigned long long)count,
+               100.0 * count / total, opcodeName((uint8_t)order[i]));
+    }
+    free(order);
+}
+
+static void printPairs(const char* title, OpCounts* counts, int rows) {
+    uint64_t total;
+    int* order = rank(&counts->pairs[0][0], PAIR_COUNT, &total);
+    printf("\n%s: %llu pairs\n", title, (unsigned long long)total);
+    printf("  %14s %7s %7s  %s\n", "count", "%", "cum %", "first -> second");
+    uint64_t cumulative = 0;
+    for (int i = 0; i < rows && i < PAIR_COUNT; i++) {
+        int first = order[i] / UINT8_COUNT;
+        int second = order[i] % UINT8_COUNT;
+        uint64_t count = counts->pairs[first][second];
+        if (count == 0) break;
+        cumulative += count;
+        printf("  %14llu %6.2f%% %6.2f%%  %s -> %s\n",
+               (unsigned long long)count, 100.0 * count / total,
+               100.0 * cumulative / total, opcodeName((uint8_t)first),
+               opcodeName((uint8_t)second));
+    }
+    free(order);
+}
+
+int main(int argc, char* argv[]) {
+    int rows = DEFAULT_ROWS;
+    glob_t paths = {0};
+    int globFlags = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            rows = atoi(argv[++i]);
+        } else {
+            glob(argv[i], globFlags, NULL, &paths);
+            globFlags = GLOB_APPEND;
+        }
+    }
+    if (globFlags == 0) {
+        glob("examples/*/*.fls", 0, NULL, &paths);
+        glob("std/*.fls", GLOB_APPEND, NULL, &paths);
+    }
+
+    if (paths.gl_pathc == 0) {
+        fprintf(stderr, "No scripts; run from the repository root.\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < paths.gl_pathc; i++) {
+        const char* path = paths.gl_pathv[i];
+        char* source = readWholeFile(path);
+        if (source == NULL) {
+            printf("  %-40s could not be read\n", path);
+            continue;
+        }
+        InterpretResult result = runQuietly(path, source);
+        printf("  %-40s %s\n", path,
+               result == INTERPRET_OK            ? "ok"
+               : result == INTERPRET_COMPILE_ERROR ? "compile error"
+                                                   : "runtime error");
+        free(source);
+    }
+    globfree(&paths);
+
+    printOps("Executed", &executedOps, rows);
+    printPairs("Executed", &executedOps, rows);
+    printPairs("Compiled", &compiledOps, rows);
+    return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef FLS_BYTECODE_H
+#define FLS_BYTECODE_H
+
+#include <stddef.h>
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// A compiled script can be saved as an image: the script function's chunk
+// (code, line table and constants) and every function nested in it. Images
+// are made by `fls --compile` and by the module cache, and run directly by
+// passing one to fls in place of a source file.
+//
+// Images are mapped rather than read, and code runs from the mapping. A
+// function's constants, and the functions nested in it, are only read when
+// it is first called, so loading costs little more than the page faults of
+// the code that actually runs.
+//
+// Global slots are only assigned when a VM first sees a name, so an image
+// lists the name of every global its code uses and operands are rewritten
+// on load if a slot moved. A fresh VM assigns the same slots as the one
+// that compiled the image, so usually nothing is written and processes
+// running the same image share its pages.
+//
+// Images are bounds-checked as they are read, not verified: load only
+// images this VM wrote.
+#define BYTECODE_MAGIC "FLSC"
+#define BYTECODE_MAGIC_LENGTH 4
+// Bump whenever the instruction set or the image layout changes. Images of
+// any other version are rejected.
+#define BYTECODE_VERSION 2
+
+// Identifies the source an image was compiled from, so a cached image can
+// be checked against the file it stands for.
+typedef struct {
+    uint64_t mtime;
+    uint64_t size;
+    uint32_t hash;
+} SourceStamp;
+
+// Fills in the stamp of the source at path, whose contents are source.
+// Returns false if the file cannot be found.
+bool stampSource(const char* path, const char* source, SourceStamp* stamp);
+
+// Writes the image of function, compiled from sourcePath, to path. The file
+// is written under a temporary name and renamed into place, so readers never
+// see half an image. Returns false if it could not be written.
+bool saveImage(const char* path, ObjFunction* function, const char* sourcePath,
+               const SourceStamp* stamp);
+
+// Returns true if the file at path starts like an image of any version.
+bool isImageFile(const char* path);
+
+// Maps the image at path and loads its script function into module. With a
+// NULL module, a new one is named after the source path the image was
+// compiled from, so runtime errors still show source lines. Returns NULL
+// if the file cannot be mapped, is of another version, or is damaged.
+ObjFunction* loadImage(const char* path, ObjModule* module);
+
+// Reads the constants of a function loaded from an image and moves its
+// global operands to this VM's slots. call() does this before the first
+// run. Returns false if the image is damaged or uses more globals than
+// the function's instructions can address.
+bool linkFunction(ObjFunction* function);
+
+// Unmaps every image. Only freeVM() may call this, since loaded functions
+// run from the mappings.
+void freeImages();
+
+// Compiles an imported module, or loads it from the module cache when the
+// cache holds an image of the same source. A module that had to be compiled
+// is added to the cache. Returns NULL on a compile error.
+//
+// The cache lives in $FLS_CACHE_DIR, $XDG_CACHE_HOME/fls or ~/.cache/fls,
+// one image per module path. An image is used only when the module's mtime,
+// size and content hash all match the ones it was compiled from. Failing to
+// read or write the cache is never an error; the module is just compiled.
+ObjFunction* compileModule(const char* path, const char* source, ObjModule* module);
+
+// Compiles the script at path, whose contents are source, and writes its
+// image to outputPath. Reports errors and returns false if either fails.
+bool compileImage(const char* path, const char* source, const char* outputPath);
+
+#endif // FLS_BYTECODE_H
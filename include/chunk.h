@@ -4,26 +4,44 @@
 #include "common.h"
 #include "value.h"
 
+// The largest operand of the _LONG instructions, which take three bytes
+// where their short forms take one or two: constant indexes, local and
+// global slots, and jump distances.
+#define OPERAND_LONG_MAX 0xffffff
+
 // Opcodes for the virtual machine.
 typedef enum {
     OP_CONSTANT,
+    OP_CONSTANT_LONG,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
     OP_POP,
     OP_GET_LOCAL,
+    OP_GET_LOCAL_LONG,
     OP_SET_LOCAL,
+    OP_SET_LOCAL_LONG,
     OP_GET_GLOBAL,
+    OP_GET_GLOBAL_LONG,
     OP_DEFINE_GLOBAL,
+    OP_DEFINE_GLOBAL_LONG,
     OP_SET_GLOBAL,
+    OP_SET_GLOBAL_LONG,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_EXPORT_VAR,
     OP_EQUAL,
+    OP_NOT_EQUAL,
     OP_GREATER,
+    OP_GREATER_EQUAL,
     OP_LESS,
+    OP_LESS_EQUAL,
     OP_ADD,
+    OP_ADD_LOCALS,
+    OP_ADD_LOCAL_CONST,
+    OP_INC_LOCAL,
     OP_SUBTRACT,
+    OP_SUBTRACT_LOCAL_CONST,
     OP_MULTIPLY,
     OP_DIVIDE,
     OP_MODULO,
@@ -31,18 +49,41 @@ typedef enum {
     OP_NEGATE,
     OP_PRINT,
     OP_JUMP,
+    OP_JUMP_LONG,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_FALSE_LONG,
+    OP_JUMP_IF_FALSE_POP,
+    OP_LESS_LOCAL_LOCAL_JUMP,
+    OP_LESS_LOCAL_CONST_JUMP,
     OP_LOOP,
+    OP_LOOP_LONG,
     OP_CALL,
+    OP_TAIL_CALL,
     OP_NEW_LIST,
     OP_LIST_APPEND,
     OP_GET_SUBSCRIPT,
     OP_SET_SUBSCRIPT,
+    OP_LIST_GET,
+    OP_LIST_SET,
+    OP_LIST_LEN,
     OP_RETURN,
     OP_IMPORT,
     OP_EXPORT,
+    OP_EXPORT_LONG,
 } OpCode;
 
+// Operand bytes and net stack effect of each opcode. OP_CALL also pops its
+// arguments, which call() accounts for since the count is in the operand.
+typedef struct {
+    int operandBytes;
+    int stackEffect;
+} OpInfo;
+
+extern const OpInfo opInfo[];
+
+// The number of opcodes; bytes at or above it are not instructions.
+extern const int opcodeCount;
+
 // A chunk of bytecode.
 typedef struct {
     int count;
@@ -50,11 +91,19 @@ typedef struct {
     uint8_t* code;
     int* lines;
     ValueArray constants;
+    // Set when the chunk was loaded from a mapped bytecode image. The code
+    // then points into the mapping, which the chunk does not own, and
+    // lines is NULL: line numbers are looked up in the image's runs of
+    // (line, length) pairs instead.
+    const uint8_t* lineRuns;
+    int lineRunCount;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+// Returns the source line of the instruction at offset.
+int getLine(Chunk* chunk, int offset);
 
 #endif
@@ -7,7 +7,16 @@
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// Threaded dispatch in the interpreter loop needs the GCC/Clang
+// labels-as-values extension. Define FLS_NO_COMPUTED_GOTO to use the
+// portable switch instead.
+#if defined(__GNUC__) && !defined(FLS_NO_COMPUTED_GOTO)
+#define FLS_COMPUTED_GOTO
+#endif
+
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_PRINT_CODE
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
 
 #endif
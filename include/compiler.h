@@ -8,4 +8,7 @@
 // Compiles source code and returns the top-level function, or NULL on error.
 ObjFunction* compile(const char* source, ObjModule* module);
 
+// Marks the functions of every compiler still in progress as GC roots.
+void markCompilerRoots();
+
 #endif
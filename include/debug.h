@@ -11,4 +11,25 @@ void disassembleChunk(Chunk* chunk, const char* name);
 // Returns the offset of the next instruction.
 int disassembleInstruction(Chunk* chunk, int offset);
 
+// Prints a chunk's instruction count before and after the compiler's
+// peephole pass.
+void printInstructionCounts(const char* name, int before, int after);
+
+// Returns the name of an opcode, like "OP_ADD", or NULL if it is not one.
+const char* opcodeName(uint8_t op);
+
+#ifdef FLS_OP_PAIRS
+// How often each instruction, and each instruction directly followed by
+// another, occurs. Built with -DFLS_OP_PAIRS for bench/op_pairs, where the
+// VM fills executedOps as it dispatches and the compiler fills compiledOps
+// from every chunk it finishes.
+typedef struct {
+    uint64_t ops[UINT8_COUNT];
+    uint64_t pairs[UINT8_COUNT][UINT8_COUNT];
+} OpCounts;
+
+extern OpCounts executedOps;
+extern OpCounts compiledOps;
+#endif
+
 #endif // FLS_DEBUG_H
@@ -0,0 +1,28 @@
+#ifndef FLS_HASH_H
+#define FLS_HASH_H
+
+#include <stdint.h>
+
+// Strings shorter than this are hashed with FNV-1a. Longer ones use a block
+// hash over eight 32-bit lanes, which is vectorised when the CPU allows.
+#define HASH_BLOCK_MIN_LENGTH 32
+
+typedef uint32_t (*HashFn)(const char* key, int length);
+
+typedef struct {
+    const char* name;
+    HashFn function;
+} HashImplementation;
+
+// The hash used for every string in the VM.
+uint32_t hashBytes(const char* key, int length);
+
+// FNV-1a over the whole input, regardless of length.
+uint32_t hashFnv1a(const char* key, int length);
+
+// Lists the block hash implementations usable on this CPU, portable scalar
+// first and the one hashBytes() picks last. They all return the same value
+// for the same input. Returns how many were written.
+int hashBlockImplementations(HashImplementation* out, int capacity);
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef FLS_MAP_H
+#define FLS_MAP_H
+
+#include "common.h"
+#include "value.h"
+
+// Slots are probed a group at a time, one control byte per slot.
+#define MAP_GROUP_SIZE 16
+
+// The most slots a map grows to; doubling it would overflow an int.
+#define MAP_MAX_CAPACITY (1 << 30)
+
+// The hash map behind ObjMap. Each slot has a control byte that is either
+// empty, deleted, or the top seven bits of the key's hash, so a whole group
+// of slots can be matched against a key in one SSE2 compare before any key
+// is touched. Keys and values live in their own arrays.
+//
+// Keys may be any value. Numbers, booleans and nil compare by value, strings
+// by contents and other objects by identity. Keys are stored in the
+// canonical form mapKey() produces, so equal keys are always identical.
+//
+// The control array has MAP_GROUP_SIZE extra bytes mirroring the first
+// group, so a group starting near the end can be loaded without wrapping.
+typedef struct {
+    int count;
+    // Zero or a power of two no smaller than MAP_GROUP_SIZE.
+    int capacity;
+    // Inserts left before the table must be rehashed.
+    int growthLeft;
+    uint8_t* control;
+    Value* keys;
+    Value* values;
+
+    // Once the owning map is old, slots written since the last collection
+    // are logged so a minor collection traces only those. allDirty is set
+    // when the log stops being worth keeping.
+    bool logWrites;
+    bool allDirty;
+    int dirtyCount;
+    int dirtyCapacity;
+    int* dirtySlots;
+} MapTable;
+
+void initMapTable(MapTable* table);
+void freeMapTable(MapTable* table);
+
+// Puts a script value into canonical key form: strings are replaced by
+// their interned copy and -0 by 0. With create, strings are interned if
+// needed; the caller must keep *key rooted. Returns false when no such key
+// can be in a map: NaN, which never equals itself, or, without create, a
+// string that was never interned.
+bool mapKey(Value* key, bool create);
+
+// Gets a value from the map. Returns true if the key was found.
+bool mapTableGet(MapTable* table, Value key, Value* value);
+
+// Adds or updates a key. Returns true if it's a new key.
+bool mapTableSet(MapTable* table, Value key, Value value);
+
+// Deletes a key. Returns true if the key was found and deleted.
+bool mapTableDelete(MapTable* table, Value key);
+
+// Copies every entry of from into to, replacing existing keys.
+void mapTableAddAll(MapTable* from, MapTable* to);
+
+// Returns the first occupied slot after slot, or -1 when there is none.
+// Start from -1. Deleting keys keeps the remaining slots in place, but an
+// insert may rehash and move them.
+int mapTableNext(MapTable* table, int slot);
+
+// Grows the map so that it holds count keys without rehashing. Returns
+// false, leaving the map as it was, if no map can hold that many keys.
+bool mapTableReserve(MapTable* table, int count);
+
+// Marks every key and value in the map as reachable.
+void markMapTable(MapTable* table);
+
+// Marks only the slots written since the write log was last cleared, or
+// everything if the log overflowed. Used by minor collections.
+void markMapTableWrites(MapTable* table);
+
+// Forgets the logged writes once a collection has traced them.
+void clearMapTableWrites(MapTable* table);
+
+#endif // FLS_MAP_H
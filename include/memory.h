@@ -19,8 +19,30 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Write barrier: use after storing a value into an object that already
+// existed, so a minor collection can find young objects only it refers to.
+#define WRITE_BARRIER(object) \
+    do { \
+        Obj* barrierObject = (Obj*)(object); \
+        if (!barrierObject->isYoung && !barrierObject->isRemembered) { \
+            rememberObject(barrierObject); \
+        } \
+    } while (false)
+
 // Main memory management function for resizing dynamic arrays.
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+// Marks an object (or the object inside a value) as reachable and queues it
+// on the gray stack so the collector traces its references.
+void markObject(Obj* object);
+void markValue(Value value);
+// Adds an old object to the remembered set. Use WRITE_BARRIER instead.
+void rememberObject(Obj* object);
+// Runs a full mark-and-sweep collection. Called from reallocate() once
+// bytesAllocated passes nextGC.
+void collectGarbage();
+// Runs a minor collection over young objects only, promoting survivors.
+// Called from reallocate() every NURSERY_SIZE bytes.
+void collectNursery();
 // Frees all allocated objects.
 void freeObjects();
 
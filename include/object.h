@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "map.h"
 #include "table.h"
 #include "value.h"
 
@@ -16,6 +17,8 @@
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
 #define IS_UPVALUE(value)      isObjType(value, OBJ_UPVALUE)
 #define IS_MAP(value)         isObjType(value, OBJ_MAP)
+#define IS_ROPE(value)         isObjType(value, OBJ_ROPE)
+#define IS_STRING_BUILDER(value) isObjType(value, OBJ_STRING_BUILDER)
 
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
@@ -26,6 +29,8 @@
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 #define AS_UPVALUE(value)      ((ObjUpvalue*)AS_OBJ(value))
 #define AS_MAP(value)         ((ObjMap*)AS_OBJ(value))
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
+#define AS_STRING_BUILDER(value) ((ObjStringBuilder*)AS_OBJ(value))
 
 typedef enum {
   OBJ_CLOSURE,
@@ -35,11 +40,18 @@ typedef enum {
   OBJ_NATIVE,
   OBJ_STRING,
   OBJ_UPVALUE,
-  OBJ_MAP
+  OBJ_MAP,
+  OBJ_ROPE,
+  OBJ_STRING_BUILDER
 } ObjType;
 
 struct Obj {
   ObjType type;
+  bool isMarked;
+  // Set until the object survives its first collection. Old objects are
+  // skipped by minor collections unless they are in the remembered set.
+  bool isYoung;
+  bool isRemembered;
   struct Obj* next;
 };
 
@@ -47,9 +59,18 @@ typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  // Stack slots one activation can use, including the callee and its
+  // arguments. Computed by the compiler so call() can check for overflow
+  // once instead of on every push.
+  int maxStackDepth;
   Chunk chunk;
   ObjString* name;
   struct ObjModule* module;
+  // Set while a function loaded from a bytecode image has not run yet. Its
+  // constants are still in the image, at constantsOffset, and call() links
+  // it before its first instruction.
+  struct BytecodeImage* image;
+  size_t constantsOffset;
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
@@ -59,13 +80,47 @@ typedef struct {
   NativeFn function;
 } ObjNative;
 
+// Only identifiers, constants and strings used as table keys are interned.
+// Everything else skips the intern table and hashes its contents lazily,
+// the first time it is needed.
 struct ObjString {
   Obj obj;
   int length;
-  char* chars;
   uint32_t hash;
+  bool hasHash;
+  bool isInterned;
+  // The characters live in the same allocation, right after the header,
+  // and are always NUL-terminated.
+  char chars[];
 };
 
+// Bytes allocated for a string of the given length, header included.
+#define STRING_SIZE(length) (sizeof(ObjString) + (size_t)(length) + 1)
+
+// Concatenations at least this long produce a rope instead of copying.
+#define ROPE_MIN_LENGTH 128
+
+// The unflattened result of a long concatenation. left and right are each
+// an ObjString or another ObjRope. The first time the characters are needed
+// the rope is flattened into a string, which is cached in flat
+// and replaces the children.
+typedef struct {
+  Obj obj;
+  int length;
+  Obj* left;
+  Obj* right;
+  ObjString* flat;
+} ObjRope;
+
+// A growable character buffer for building long strings without creating
+// an intermediate string per append.
+typedef struct {
+  Obj obj;
+  char* chars;
+  int length;
+  int capacity;
+} ObjStringBuilder;
+
 typedef struct ObjUpvalue {
   Obj obj;
   Value* location;
@@ -87,7 +142,7 @@ typedef struct {
 
 typedef struct {
   Obj obj;
-  Table table;
+  MapTable table;
 } ObjMap;
 
 typedef struct ObjModule {
@@ -106,8 +161,22 @@ ObjList* newList();
 ObjMap* newMap();
 ObjModule* newModule(ObjString* name);
 ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
+ObjString* newString(int length);
+ObjString* newStringCopy(const char* chars, int length);
+// Returns the interned string, creating it if needed.
 ObjString* copyString(const char* chars, int length);
+// Returns the interned string equal to string, interning string itself if
+// there is none. Table keys must go through this.
+ObjString* internString(ObjString* string);
+// Like internString() but never adds to the table: returns NULL when no
+// equal string is interned, which means it cannot be a key in any table.
+ObjString* findInterned(ObjString* string);
+uint32_t stringHash(ObjString* string);
+bool stringsEqual(ObjString* a, ObjString* b);
+ObjRope* newRope(Obj* left, Obj* right, int length);
+ObjString* flattenRope(ObjRope* rope);
+ObjStringBuilder* newStringBuilder();
+void builderAppend(ObjStringBuilder* builder, const char* chars, int length);
 ObjUpvalue* newUpvalue(Value* slot);
 void printObject(Value value);
 
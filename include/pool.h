@@ -0,0 +1,56 @@
+#ifndef FLS_POOL_H
+#define FLS_POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Requests up to POOL_MAX_SIZE bytes are rounded up to a multiple of
+// POOL_GRANULARITY and served from that size class. Larger requests go to
+// the system allocator.
+#define POOL_GRANULARITY 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASS_COUNT (POOL_MAX_SIZE / POOL_GRANULARITY)
+#define POOL_SLAB_SIZE (64 * 1024)
+
+// A free block holds the link to the next free block of its class.
+typedef struct PoolBlock {
+    struct PoolBlock* next;
+} PoolBlock;
+
+// Slabs are chained through a header at their start so they can be
+// released at exit.
+typedef struct PoolSlab {
+    struct PoolSlab* next;
+} PoolSlab;
+
+typedef struct {
+    PoolBlock* freeList;
+    // Unused tail of the newest slab, carved up before it is needed.
+    char* bumpStart;
+    char* bumpEnd;
+    PoolSlab* slabs;
+    int slabCount;
+    size_t liveBlocks;
+    size_t liveBytes;
+    size_t totalAllocations;
+} PoolClass;
+
+// Whether a block of this size lives in the pool. Zero-sized requests
+// never allocate, so they belong to neither side.
+static inline bool poolHandles(size_t size) {
+    return size != 0 && size <= POOL_MAX_SIZE;
+}
+
+// Returns a block of at least size bytes. size must satisfy poolHandles().
+void* poolAllocate(size_t size);
+// Returns a block to its class. size must be the size it was allocated with.
+void poolFree(void* pointer, size_t size);
+// Resizes a block when either size is pooled, copying when the block moves
+// between classes or to or from the system allocator.
+void* poolReallocate(void* pointer, size_t oldSize, size_t newSize);
+// Releases every slab. Nothing allocated from the pool may be used after.
+void freePools();
+// Prints slab counts, live bytes and fragmentation per size class.
+void dumpPoolStats();
+
+#endif
@@ -35,6 +35,13 @@ bool tableDelete(Table* table, ObjString* key);
 // Copies all entries from one table to another.
 void tableAddAll(Table* from, Table* to);
 
+// Marks every key and value in the table as reachable.
+void markTable(Table* table);
+
+// Deletes every entry whose key was not marked by the collector. Used to make
+// the intern table a weak reference.
+void tableRemoveWhite(Table* table);
+
 // Finds a string key within the table's entry array.
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
@@ -7,8 +7,18 @@
 #include "value.h"
 #include "profiler.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The call frames and the value stack start small and grow on demand, up
+// to vm.maxFrames frames. Growing may move the value stack; every pointer
+// into it is fixed up, but one held in a local is only good until the next
+// call.
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL 1024
+// The default limit on call depth, changed with --max-stack.
+#define FRAMES_MAX 100000
+// Free slots kept above every frame's own values, so the runtime's
+// temporary pushes and a native's pushes never move the stack from under
+// the interpreter loop.
+#define STACK_SLACK 16
 
 typedef struct {
     ObjFunction* function;
@@ -18,21 +28,43 @@ typedef struct {
 } CallFrame;
 
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frameCount;
+    int frameCapacity;
+    int maxFrames;
+    // run() returns when a frame returns to this depth. It is nonzero only
+    // while a native is calling back into script code.
+    int baseFrame;
 
-    Value stack[STACK_MAX];
+    Value* stack;
     Value* stackTop;
-    Table globals;
+    int stackCapacity;
+    // Globals live in a dense array indexed by slots the compiler resolves.
+    // globalSlots maps each name to its slot for late binding and lookups
+    // by name; globalNames maps a slot back to its name.
+    Table globalSlots;
+    ValueArray globalValues;
+    ValueArray globalNames;
     Table modules;
     Table strings;
     Obj* objects;
+    Obj* youngObjects;
     bool hadError;
     size_t bytesAllocated;
     size_t nextGC;
+    int grayCount;
+    int grayCapacity;
+    Obj** grayStack;
+    size_t nurseryBytes;
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered;
     
     Profiler profiler;
     bool enable_preflight;
+    // Whether imports go through the compiled-module cache; see
+    // compileModule(). Cleared by --no-cache.
+    bool moduleCache;
     uint64_t instruction_count;
 } VM;
 
@@ -47,11 +79,16 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* path, const char* source);
+// Runs a script compiled ahead of time; see loadImage().
+InterpretResult interpretImage(const char* path);
 void push(Value value);
 Value pop();
 void runtimeError(const char* format, ...);
 void defineNative(const char* name, NativeFn function);
 void defineGlobal(const char* name, Value value);
+int globalSlot(ObjString* name);
+bool getGlobal(ObjString* name, Value* value);
+void setGlobal(ObjString* name, Value value);
 void resetStack();
 
 #endif
@@ -0,0 +1,739 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "hash.h"
+#include "memory.h"
+
+// Image layout. Integers are little-endian and strings are a u32 length
+// followed by the bytes, with length NO_STRING standing for none.
+//
+//   header    "FLSC", u32 version, u64 source mtime, u64 source size,
+//             u32 source hash
+//   source    string: the path the image was compiled from
+//   globals   u32 count, then a u32 slot and a string name for each, in
+//             increasing slot order
+//   function  the script function:
+//               string name, u32 arity, u32 upvalue count,
+//               u32 max stack depth,
+//               u32 code length, the code,
+//               u32 line runs, then a u32 line and u32 length for each,
+//               u32 size of the rest, u32 constant count, then a u8 tag
+//               for each followed by a f64 number, a string, or a
+//               nested function
+#define HEADER_SIZE 28
+#define NO_STRING UINT32_MAX
+
+typedef enum {
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+} ConstantTag;
+
+// Returns the width of an instruction's global slot operand, or 0 if it
+// does not name a global.
+static int globalOperandWidth(uint8_t instruction) {
+    switch (instruction) {
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+            return 2;
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+// Operands are big-endian, like READ_SHORT() and READ_LONG() expect.
+static uint32_t readOperand(const uint8_t* code, int width) {
+    uint32_t value = 0;
+    for (int i = 0; i < width; i++) value = (value << 8) | code[i];
+    return value;
+}
+
+static void writeOperand(uint8_t* code, int width, uint32_t value) {
+    for (int i = width - 1; i >= 0; i--) {
+        code[i] = (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+// --- Writing ---
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} Writer;
+
+static void writeBytes(Writer* writer, const void* bytes, size_t length) {
+    if (writer->count + length > writer->capacity) {
+        size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+        while (capacity < writer->count + length) capacity *= 2;
+        writer->bytes = realloc(writer->bytes, capacity);
+        if (writer->bytes == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        writer->capacity = capacity;
+    }
+    memcpy(writer->bytes + writer->count, bytes, length);
+    writer->count += length;
+}
+
+static void writeU8(Writer* writer, uint8_t value) {
+    writeBytes(writer, &value, 1);
+}
+
+static void putU32(uint8_t* bytes, uint32_t value) {
+    for (int i = 0; i < 4; i++) bytes[i] = (uint8_t)(value >> (8 * i));
+}
+
+static void writeU32(Writer* writer, uint32_t value) {
+    uint8_t bytes[4];
+    putU32(bytes, value);
+    writeBytes(writer, bytes, 4);
+}
+
+static void writeU64(Writer* writer, uint64_t value) {
+    writeU32(writer, (uint32_t)value);
+    writeU32(writer, (uint32_t)(value >> 32));
+}
+
+static void writeString(Writer* writer, ObjString* string) {
+    if (string == NULL) {
+        writeU32(writer, NO_STRING);
+        return;
+    }
+    writeU32(writer, (uint32_t)string->length);
+    writeBytes(writer, string->chars, (size_t)string->length);
+}
+
+// The global slots an image's code refers to.
+typedef struct {
+    uint32_t* slots;
+    int count;
+    int capacity;
+} SlotList;
+
+static void collectGlobals(ObjFunction* function, SlotList* list) {
+    Chunk* chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += 1 + opInfo[chunk->code[offset]].operandBytes) {
+        int width = globalOperandWidth(chunk->code[offset]);
+        if (width == 0) continue;
+
+        if (list->count == list->capacity) {
+            list->capacity = list->capacity < 16 ? 16 : list->capacity * 2;
+            list->slots = realloc(list->slots, sizeof(uint32_t) * list->capacity);
+            if (list->slots == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(1);
+            }
+        }
+        list->slots[list->count++] = readOperand(&chunk->code[offset + 1], width);
+    }
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_FUNCTION(constant)) collectGlobals(AS_FUNCTION(constant), list);
+    }
+}
+
+static int compareSlots(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void writeGlobals(Writer* writer, ObjFunction* function) {
+    SlotList list = {NULL, 0, 0};
+    collectGlobals(function, &list);
+    if (list.count > 0) {
+        qsort(list.slots, list.count, sizeof(uint32_t), compareSlots);
+    }
+
+    int unique = 0;
+    for (int i = 0; i < list.count; i++) {
+        if (unique == 0 || list.slots[unique - 1] != list.slots[i]) {
+            list.slots[unique++] = list.slots[i];
+        }
+    }
+
+    writeU32(writer, (uint32_t)unique);
+    for (int i = 0; i < unique; i++) {
+        writeU32(writer, list.slots[i]);
+        writeString(writer, AS_STRING(vm.globalNames.values[list.slots[i]]));
+    }
+    free(list.slots);
+}
+
+static bool writeFunction(Writer* writer, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    writeString(writer, function->name);
+    writeU32(writer, (uint32_t)function->arity);
+    writeU32(writer, (uint32_t)function->upvalueCount);
+    writeU32(writer, (uint32_t)function->maxStackDepth);
+
+    writeU32(writer, (uint32_t)chunk->count);
+    writeBytes(writer, chunk->code, (size_t)chunk->count);
+
+    // Lines change every few bytes at most, so store them as runs.
+    size_t runCountOffset = writer->count;
+    uint32_t runs = 0;
+    writeU32(writer, 0);
+    for (int start = 0; start < chunk->count;) {
+        int end = start + 1;
+        while (end < chunk->count && chunk->lines[end] == chunk->lines[start]) end++;
+        writeU32(writer, (uint32_t)chunk->lines[start]);
+        writeU32(writer, (uint32_t)(end - start));
+        runs++;
+        start = end;
+    }
+    putU32(writer->bytes + runCountOffset, runs);
+
+    // The constants' size lets a loader skip them until the function runs.
+    size_t constantsSizeOffset = writer->count;
+    writeU32(writer, 0);
+    writeU32(writer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_NUMBER(constant)) {
+            double number = AS_NUMBER(constant);
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            writeU8(writer, CONSTANT_NUMBER);
+            writeU64(writer, bits);
+        } else if (IS_STRING(constant)) {
+            writeU8(writer, CONSTANT_STRING);
+            writeString(writer, AS_STRING(constant));
+        } else if (IS_FUNCTION(constant)) {
+            writeU8(writer, CONSTANT_FUNCTION);
+            if (!writeFunction(writer, AS_FUNCTION(constant))) return false;
+        } else {
+            return false;
+        }
+    }
+    putU32(writer->bytes + constantsSizeOffset,
+           (uint32_t)(writer->count - constantsSizeOffset - 4));
+    return true;
+}
+
+// Writes bytes to a temporary file next to path and renames it over path.
+static bool writeFileAtomically(const char* path, const uint8_t* bytes, size_t size) {
+    char temporary[PATH_MAX];
+    int length = snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path,
+                          (long)getpid());
+    if (length < 0 || (size_t)length >= sizeof(temporary)) return false;
+
+    FILE* file = fopen(temporary, "wb");
+    if (file == NULL) return false;
+    bool written = fwrite(bytes, 1, size, file) == size;
+    if (fclose(file) != 0) written = false;
+
+    if (!written || rename(temporary, path) != 0) {
+        remove(temporary);
+        return false;
+    }
+    return true;
+}
+
+bool saveImage(const char* path, ObjFunction* function, const char* sourcePath,
+               const SourceStamp* stamp) {
+    Writer writer = {NULL, 0, 0};
+    writeBytes(&writer, BYTECODE_MAGIC, BYTECODE_MAGIC_LENGTH);
+    writeU32(&writer, BYTECODE_VERSION);
+    writeU64(&writer, stamp->mtime);
+    writeU64(&writer, stamp->size);
+    writeU32(&writer, stamp->hash);
+
+    writeU32(&writer, (uint32_t)strlen(sourcePath));
+    writeBytes(&writer, sourcePath, strlen(sourcePath));
+    writeGlobals(&writer, function);
+
+    bool saved = writeFunction(&writer, function) &&
+                 writeFileAtomically(path, writer.bytes, writer.count);
+    free(writer.bytes);
+    return saved;
+}
+
+// --- Loading ---
+
+// An image in memory: a private mapping of the file, so code can run where
+// it lies and pages no one writes stay shared with every other process
+// mapping it. Functions point into their image, so images stay loaded
+// until the VM is freed.
+typedef struct BytecodeImage {
+    struct BytecodeImage* next;
+    uint8_t* bytes;
+    size_t size;
+    // False if the file could not be mapped and was read onto the heap.
+    bool mapped;
+
+    // Each global's slot in the VM that wrote the image, in increasing
+    // order, and its slot in this one. A fresh VM assigns slots in the same
+    // order as the one that compiled the image; only when some slot moved
+    // does code need rewriting.
+    uint32_t* oldSlots;
+    int* newSlots;
+    int globalCount;
+    bool slotsMoved;
+} BytecodeImage;
+
+static BytecodeImage* images = NULL;
+
+typedef struct {
+    BytecodeImage* image;
+    size_t offset;
+    // Set by the first read past the end or of a malformed value. Later
+    // reads return zeros, so callers check it once at the end.
+    bool failed;
+} Reader;
+
+static const uint8_t* readBytes(Reader* reader, size_t length) {
+    BytecodeImage* image = reader->image;
+    if (reader->failed || length > image->size - reader->offset) {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t* bytes = image->bytes + reader->offset;
+    reader->offset += length;
+    return bytes;
+}
+
+static uint32_t getU32(const uint8_t* bytes) {
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+           (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static uint8_t readU8(Reader* reader) {
+    const uint8_t* bytes = readBytes(reader, 1);
+    return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint32_t readU32(Reader* reader) {
+    const uint8_t* bytes = readBytes(reader, 4);
+    return bytes == NULL ? 0 : getU32(bytes);
+}
+
+static uint64_t readU64(Reader* reader) {
+    uint64_t low = readU32(reader);
+    return low | (uint64_t)readU32(reader) << 32;
+}
+
+// Reads a count of items that each take at least itemSize bytes, failing
+// if the rest of the image is too short to hold them.
+static int readCount(Reader* reader, size_t itemSize) {
+    uint32_t count = readU32(reader);
+    size_t left = reader->image->size - reader->offset;
+    if (count > INT_MAX || count > left / itemSize) {
+        reader->failed = true;
+        return 0;
+    }
+    return (int)count;
+}
+
+// Returns the interned string, or NULL for none or on failure.
+static ObjString* readString(Reader* reader) {
+    uint32_t length = readU32(reader);
+    if (length == NO_STRING || length > INT_MAX) return NULL;
+    const char* chars = (const char*)readBytes(reader, length);
+    if (chars == NULL) return NULL;
+    return copyString(chars, (int)length);
+}
+
+static bool readGlobals(Reader* reader) {
+    BytecodeImage* image = reader->image;
+    int count = readCount(reader, 8);
+    if (count == 0) return !reader->failed;
+
+    image->oldSlots = malloc(sizeof(uint32_t) * count);
+    image->newSlots = malloc(sizeof(int) * count);
+    if (image->oldSlots == NULL || image->newSlots == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        uint32_t slot = readU32(reader);
+        ObjString* name = readString(reader);
+        if (name == NULL || (i > 0 && slot <= image->oldSlots[i - 1])) {
+            reader->failed = true;
+            return false;
+        }
+        image->oldSlots[i] = slot;
+        image->newSlots[i] = globalSlot(name);
+        image->globalCount = i + 1;
+        if ((uint32_t)image->newSlots[i] != slot) image->slotsMoved = true;
+    }
+    return true;
+}
+
+// Returns this VM's slot for a global the image's code refers to, or -1.
+static int remapGlobal(BytecodeImage* image, uint32_t slot) {
+    int low = 0;
+    int high = image->globalCount - 1;
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        if (image->oldSlots[middle] == slot) return image->newSlots[middle];
+        if (image->oldSlots[middle] < slot) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return -1;
+}
+
+// Moves the global operands of a chunk to this VM's slots. Only operands
+// that change are written, so untouched pages of the mapping stay shared.
+// Nothing is written unless every instruction is known and every slot
+// fits its operand.
+static bool relocateCode(BytecodeImage* image, Chunk* chunk) {
+    for (int pass = 0; pass < 2; pass++) {
+        int offset = 0;
+        while (offset < chunk->count) {
+            uint8_t instruction = chunk->code[offset];
+            if (instruction >= opcodeCount) return false;
+            int next = offset + 1 + opInfo[instruction].operandBytes;
+            if (next > chunk->count) return false;
+
+            int width = globalOperandWidth(instruction);
+            if (width > 0) {
+                uint8_t* operand = &chunk->code[offset + 1];
+                uint32_t oldSlot = readOperand(operand, width);
+                int slot = remapGlobal(image, oldSlot);
+                if (slot < 0 || slot > (width == 2 ? UINT16_MAX : OPERAND_LONG_MAX)) {
+                    return false;
+                }
+                if (pass == 1 && (uint32_t)slot != oldSlot) {
+                    writeOperand(operand, width, (uint32_t)slot);
+                }
+            }
+            offset = next;
+        }
+    }
+    return true;
+}
+
+// Reads a function up to its constants, which linkFunction() reads when
+// it is first called. The code and line runs are left in the image.
+static ObjFunction* readFunction(Reader* reader, ObjModule* module) {
+    ObjFunction* function = newFunction();
+    function->module = module;
+    push(OBJ_VAL(function));
+
+    function->name = readString(reader);
+    WRITE_BARRIER(function);
+    function->arity = (int)readU32(reader);
+    function->upvalueCount = (int)readU32(reader);
+    function->maxStackDepth = (int)readU32(reader);
+
+    int codeCount = readCount(reader, 1);
+    const uint8_t* code = readBytes(reader, (size_t)codeCount);
+    int runCount = readCount(reader, 8);
+    const uint8_t* runs = readBytes(reader, (size_t)runCount * 8);
+    uint32_t constantsSize = readU32(reader);
+    size_t constantsOffset = reader->offset;
+    readBytes(reader, constantsSize);
+    pop();
+
+    if (reader->failed || codeCount == 0 || runCount == 0) {
+        reader->failed = true;
+        return NULL;
+    }
+
+    Chunk* chunk = &function->chunk;
+    chunk->code = (uint8_t*)code;
+    chunk->count = codeCount;
+    chunk->lineRuns = runs;
+    chunk->lineRunCount = runCount;
+    function->image = reader->image;
+    function->constantsOffset = constantsOffset;
+    return function;
+}
+
+bool linkFunction(ObjFunction* function) {
+    BytecodeImage* image = function->image;
+    Chunk* chunk = &function->chunk;
+    Reader reader = {image, function->constantsOffset, false};
+
+    // Start over if an earlier attempt failed partway.
+    chunk->constants.count = 0;
+    int constantCount = readCount(&reader, 1);
+    for (int i = 0; i < constantCount && !reader.failed; i++) {
+        Value constant;
+        switch (readU8(&reader)) {
+            case CONSTANT_NUMBER: {
+                uint64_t bits = readU64(&reader);
+                double number;
+                memcpy(&number, &bits, sizeof(number));
+                constant = NUMBER_VAL(number);
+                break;
+            }
+            case CONSTANT_STRING: {
+                ObjString* string = readString(&reader);
+                if (string == NULL) reader.failed = true;
+                constant = string == NULL ? NIL_VAL : OBJ_VAL(string);
+                break;
+            }
+            case CONSTANT_FUNCTION: {
+                ObjFunction* nested = readFunction(&reader, function->module);
+                constant = nested == NULL ? NIL_VAL : OBJ_VAL(nested);
+                break;
+            }
+            default:
+                reader.failed = true;
+                constant = NIL_VAL;
+                break;
+        }
+        addConstant(chunk, constant);
+        WRITE_BARRIER(function);
+    }
+
+    if (reader.failed) return false;
+    if (image->slotsMoved && !relocateCode(image, chunk)) return false;
+    function->image = NULL;
+    return true;
+}
+
+static bool isImageHeader(const uint8_t* bytes, size_t size) {
+    return size >= BYTECODE_MAGIC_LENGTH &&
+           memcmp(bytes, BYTECODE_MAGIC, BYTECODE_MAGIC_LENGTH) == 0;
+}
+
+bool isImageFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return false;
+    uint8_t magic[BYTECODE_MAGIC_LENGTH];
+    size_t read = fread(magic, 1, sizeof(magic), file);
+    fclose(file);
+    return isImageHeader(magic, read);
+}
+
+static void closeImage(BytecodeImage* image) {
+    if (image->mapped) {
+        munmap(image->bytes, image->size);
+    } else {
+        free(image->bytes);
+    }
+    free(image->oldSlots);
+    free(image->newSlots);
+    free(image);
+}
+
+// Maps the image at path. Copy-on-write keeps relocated pages private to
+// this process. A file that cannot be mapped is read instead.
+static BytecodeImage* openImage(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < HEADER_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)info.st_size;
+
+    bool mapped = true;
+    uint8_t* bytes = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (bytes == MAP_FAILED) {
+        mapped = false;
+        bytes = malloc(size);
+        size_t done = 0;
+        while (bytes != NULL && done < size) {
+            ssize_t count = read(fd, bytes + done, size - done);
+            if (count <= 0) {
+                free(bytes);
+                bytes = NULL;
+                break;
+            }
+            done += (size_t)count;
+        }
+    }
+    close(fd);
+    if (bytes == NULL) return NULL;
+
+    BytecodeImage* image = malloc(sizeof(BytecodeImage));
+    if (image == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    image->next = NULL;
+    image->bytes = bytes;
+    image->size = size;
+    image->mapped = mapped;
+    image->oldSlots = NULL;
+    image->newSlots = NULL;
+    image->globalCount = 0;
+    image->slotsMoved = false;
+    return image;
+}
+
+// Checks the magic and version, and reads the source stamp.
+static bool readHeader(Reader* reader, SourceStamp* stamp) {
+    if (!isImageHeader(reader->image->bytes, reader->image->size)) return false;
+    reader->offset = BYTECODE_MAGIC_LENGTH;
+    if (readU32(reader) != BYTECODE_VERSION) return false;
+
+    stamp->mtime = readU64(reader);
+    stamp->size = readU64(reader);
+    stamp->hash = readU32(reader);
+    return !reader->failed;
+}
+
+// Loads the image at path if it was compiled from a source with the
+// expected stamp, or from any source if expected is NULL.
+static ObjFunction* loadStampedImage(const char* path, const SourceStamp* expected,
+                                     ObjModule* module) {
+    BytecodeImage* image = openImage(path);
+    if (image == NULL) return NULL;
+
+    Reader reader = {image, 0, false};
+    SourceStamp stamp;
+    if (!readHeader(&reader, &stamp) ||
+        (expected != NULL &&
+         (stamp.mtime != expected->mtime || stamp.size != expected->size ||
+          stamp.hash != expected->hash))) {
+        closeImage(image);
+        return NULL;
+    }
+
+    // Keep the module on the stack while it is only referenced from here.
+    if (module == NULL) {
+        ObjString* sourcePath = readString(&reader);
+        if (sourcePath == NULL) {
+            closeImage(image);
+            return NULL;
+        }
+        push(OBJ_VAL(sourcePath));
+        module = newModule(sourcePath);
+        vm.stackTop[-1] = OBJ_VAL(module);
+    } else {
+        readBytes(&reader, readU32(&reader));
+        push(OBJ_VAL(module));
+    }
+
+    ObjFunction* function = NULL;
+    if (readGlobals(&reader)) function = readFunction(&reader, module);
+    pop();
+
+    if (function == NULL || reader.offset != image->size) {
+        closeImage(image);
+        return NULL;
+    }
+    image->next = images;
+    images = image;
+    return function;
+}
+
+ObjFunction* loadImage(const char* path, ObjModule* module) {
+    return loadStampedImage(path, NULL, module);
+}
+
+void freeImages() {
+    while (images != NULL) {
+        BytecodeImage* next = images->next;
+        closeImage(images);
+        images = next;
+    }
+}
+
+// --- The module cache ---
+
+bool stampSource(const char* path, const char* source, SourceStamp* stamp) {
+    struct stat info;
+    if (stat(path, &info) != 0) return false;
+    size_t length = strlen(source);
+    if (length > INT_MAX) return false;
+
+    stamp->mtime = (uint64_t)info.st_mtime;
+    stamp->size = (uint64_t)info.st_size;
+    stamp->hash = hashBytes(source, (int)length);
+    return true;
+}
+
+// Creates path and any missing parents.
+static bool makeDirectories(char* path) {
+    for (char* slash = strchr(path + 1, '/');; slash = strchr(slash + 1, '/')) {
+        if (slash != NULL) *slash = '\0';
+        bool made = mkdir(path, 0755) == 0 || errno == EEXIST;
+        if (slash != NULL) *slash = '/';
+        if (!made) return false;
+        if (slash == NULL) return true;
+    }
+}
+
+// Finds the cache file for the module at path, creating the cache
+// directory if needed. Modules are keyed by their resolved path.
+static bool cachePath(const char* path, char* out, size_t outSize) {
+    char directory[PATH_MAX];
+    const char* base;
+    int length;
+    if ((base = getenv("FLS_CACHE_DIR")) != NULL && base[0] != '\0') {
+        length = snprintf(directory, sizeof(directory), "%s", base);
+    } else if ((base = getenv("XDG_CACHE_HOME")) != NULL && base[0] != '\0') {
+        length = snprintf(directory, sizeof(directory), "%s/fls", base);
+    } else if ((base = getenv("HOME")) != NULL && base[0] != '\0') {
+        length = snprintf(directory, sizeof(directory), "%s/.cache/fls", base);
+    } else {
+        return false;
+    }
+    if (length < 0 || (size_t)length >= sizeof(directory)) return false;
+    if (!makeDirectories(directory)) return false;
+
+    char resolved[PATH_MAX];
+    const char* key = realpath(path, resolved) != NULL ? resolved : path;
+    length = snprintf(out, outSize, "%s/%08x.flsc", directory,
+                      hashBytes(key, (int)strlen(key)));
+    return length >= 0 && (size_t)length < outSize;
+}
+
+ObjFunction* compileModule(const char* path, const char* source, ObjModule* module) {
+    if (!vm.moduleCache) return compile(source, module);
+
+    SourceStamp stamp;
+    char cached[PATH_MAX];
+    bool cacheable = stampSource(path, source, &stamp) &&
+                     cachePath(path, cached, sizeof(cached));
+    if (cacheable) {
+        ObjFunction* function = loadStampedImage(cached, &stamp, module);
+        if (function != NULL) return function;
+    }
+
+    ObjFunction* function = compile(source, module);
+    if (function != NULL && cacheable) saveImage(cached, function, path, &stamp);
+    return function;
+}
+
+bool compileImage(const char* path, const char* source, const char* outputPath) {
+    SourceStamp stamp;
+    if (!stampSource(path, source, &stamp)) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+
+    push(OBJ_VAL(copyString(path, (int)strlen(path))));
+    ObjModule* module = newModule(AS_STRING(vm.stackTop[-1]));
+    vm.stackTop[-1] = OBJ_VAL(module);
+
+    ObjFunction* function = compile(source, module);
+    bool saved = function != NULL && saveImage(outputPath, function, path, &stamp);
+    pop();
+
+    if (function != NULL && !saved) {
+        fprintf(stderr, "Could not write \"%s\".\n", outputPath);
+    }
+    return saved;
+}
@@ -2,6 +2,71 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
+
+const OpInfo opInfo[] = {
+    [OP_CONSTANT]              = {1,  1},
+    [OP_CONSTANT_LONG]         = {3,  1},
+    [OP_NIL]                   = {0,  1},
+    [OP_TRUE]                  = {0,  1},
+    [OP_FALSE]                 = {0,  1},
+    [OP_POP]                   = {0, -1},
+    [OP_GET_LOCAL]             = {1,  1},
+    [OP_GET_LOCAL_LONG]        = {3,  1},
+    [OP_SET_LOCAL]             = {1,  0},
+    [OP_SET_LOCAL_LONG]        = {3,  0},
+    [OP_GET_GLOBAL]            = {2,  1},
+    [OP_GET_GLOBAL_LONG]       = {3,  1},
+    [OP_DEFINE_GLOBAL]         = {2, -1},
+    [OP_DEFINE_GLOBAL_LONG]    = {3, -1},
+    [OP_SET_GLOBAL]            = {2,  0},
+    [OP_SET_GLOBAL_LONG]       = {3,  0},
+    [OP_GET_PROPERTY]          = {1,  0},
+    [OP_SET_PROPERTY]          = {1, -1},
+    [OP_EXPORT_VAR]            = {1,  0},
+    [OP_EQUAL]                 = {0, -1},
+    [OP_NOT_EQUAL]             = {0, -1},
+    [OP_GREATER]               = {0, -1},
+    [OP_GREATER_EQUAL]         = {0, -1},
+    [OP_LESS]                  = {0, -1},
+    [OP_LESS_EQUAL]            = {0, -1},
+    [OP_ADD]                   = {0, -1},
+    [OP_ADD_LOCALS]            = {2,  1},
+    [OP_ADD_LOCAL_CONST]       = {2,  1},
+    [OP_INC_LOCAL]             = {2,  0},
+    [OP_SUBTRACT]              = {0, -1},
+    [OP_SUBTRACT_LOCAL_CONST]  = {2,  1},
+    [OP_MULTIPLY]              = {0, -1},
+    [OP_DIVIDE]                = {0, -1},
+    [OP_MODULO]                = {0, -1},
+    [OP_NOT]                   = {0,  0},
+    [OP_NEGATE]                = {0,  0},
+    [OP_PRINT]                 = {0, -1},
+    [OP_JUMP]                  = {2,  0},
+    [OP_JUMP_LONG]             = {3,  0},
+    [OP_JUMP_IF_FALSE]         = {2,  0},
+    [OP_JUMP_IF_FALSE_LONG]    = {3,  0},
+    [OP_JUMP_IF_FALSE_POP]     = {2, -1},
+    [OP_LESS_LOCAL_LOCAL_JUMP] = {4,  0},
+    [OP_LESS_LOCAL_CONST_JUMP] = {4,  0},
+    [OP_LOOP]                  = {2,  0},
+    [OP_LOOP_LONG]             = {3,  0},
+    [OP_CALL]                  = {1,  0},
+    [OP_TAIL_CALL]             = {1,  0},
+    [OP_NEW_LIST]              = {0,  1},
+    [OP_LIST_APPEND]           = {0, -1},
+    [OP_GET_SUBSCRIPT]         = {0, -1},
+    [OP_SET_SUBSCRIPT]         = {0, -2},
+    [OP_LIST_GET]              = {0, -2},
+    [OP_LIST_SET]              = {0, -3},
+    [OP_LIST_LEN]              = {0, -1},
+    [OP_RETURN]                = {0, -1},
+    [OP_IMPORT]                = {0,  0},
+    [OP_EXPORT]                = {1,  0},
+    [OP_EXPORT_LONG]           = {3,  0},
+};
+
+const int opcodeCount = sizeof(opInfo) / sizeof(opInfo[0]);
 
 void initChunk(Chunk* chunk) {
     chunk->count = 0;
@@ -9,11 +74,15 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->lineRuns = NULL;
+    chunk->lineRunCount = 0;
 }
 
 void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    if (chunk->lineRuns == NULL) {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    }
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -32,6 +101,27 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 }
 
 int addConstant(Chunk* chunk, Value value) {
+    // Keep the value reachable in case growing the array triggers a GC.
+    push(value);
     writeValueArray(&chunk->constants, value);
+    pop();
     return chunk->constants.count - 1;
 }
+
+// Reads a little-endian u32 from a bytecode image.
+static int readRunField(const uint8_t* bytes) {
+    return (int)((uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+                 (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24);
+}
+
+int getLine(Chunk* chunk, int offset) {
+    if (chunk->lines != NULL) return chunk->lines[offset];
+
+    int line = 0;
+    for (int i = 0; i < chunk->lineRunCount && offset >= 0; i++) {
+        const uint8_t* run = chunk->lineRuns + 8 * i;
+        line = readRunField(run);
+        offset -= readRunField(run + 4);
+    }
+    return line;
+}
@@ -9,7 +9,7 @@
 #include "object.h"
 #include "error.h"
 
-#ifdef DEBUG_PRINT_CODE
+#if defined(DEBUG_PRINT_CODE) || defined(FLS_OP_PAIRS)
 #include "debug.h"
 #endif
 
@@ -60,15 +60,32 @@ typedef enum {
     TYPE_SCRIPT
 } FunctionType;
 
+// A forward jump too far for its two-byte distance, left for the peephole
+// pass to widen.
+typedef struct {
+    int offset; // Offset of the jump instruction.
+    int target; // Offset it lands on.
+} FarJump;
+
 // Compiler state for a single function.
 typedef struct Compiler {
     struct Compiler* enclosing;
     ObjFunction* function;
     FunctionType type;
 
-    Local locals[UINT8_COUNT];
+    Local* locals;
     int localCount;
+    int localCapacity;
     int scopeDepth;
+
+    FarJump* farJumps;
+    int farJumpCount;
+    int farJumpCapacity;
+
+    int stackDepth;     // Stack slots in use at the current emit position.
+    int operandBytes;   // Operand bytes still expected for the last opcode.
+    int lastOpcode;     // Offset of the last opcode emitted, or -1.
+    int lastJumpTarget; // Offset the last patched forward jump lands on.
 } Compiler;
 
 Parser parser;
@@ -157,9 +174,25 @@ static bool match(TokenType type) {
     return true;
 }
 
+// Adjusts the tracked stack depth, recording the function's high-water mark.
+static void adjustStack(int effect) {
+    current->stackDepth += effect;
+    if (current->stackDepth > current->function->maxStackDepth) {
+        current->function->maxStackDepth = current->stackDepth;
+    }
+}
+
 // Emits a single byte to the current chunk.
 static void emitByte(uint8_t byte) {
     writeChunk(currentChunk(), byte, parser.previous.line);
+
+    if (current->operandBytes > 0) {
+        current->operandBytes--;
+    } else {
+        current->operandBytes = opInfo[byte].operandBytes;
+        current->lastOpcode = currentChunk()->count - 1;
+        adjustStack(opInfo[byte].stackEffect);
+    }
 }
 
 // Emits two bytes to the current chunk.
@@ -168,15 +201,55 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
-// Emits a loop instruction.
-static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+// Emits an instruction with a two-byte operand.
+static void emitShortOp(uint8_t instruction, uint16_t operand) {
+    emitByte(instruction);
+    emitByte((operand >> 8) & 0xff);
+    emitByte(operand & 0xff);
+}
+
+// Emits an instruction with a three-byte operand.
+static void emitLongOp(uint8_t instruction, int operand) {
+    emitByte(instruction);
+    emitByte((operand >> 16) & 0xff);
+    emitByte((operand >> 8) & 0xff);
+    emitByte(operand & 0xff);
+}
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+// Emits an instruction with a one-byte operand, or its _LONG form when the
+// operand does not fit.
+static void emitOperandOp(uint8_t instruction, uint8_t longInstruction,
+                          int operand) {
+    if (operand <= UINT8_MAX) {
+        emitBytes(instruction, (uint8_t)operand);
+    } else {
+        emitLongOp(longInstruction, operand);
+    }
+}
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+// Emits a global variable instruction, or its _LONG form past the slots a
+// two-byte operand can reach.
+static void emitGlobalOp(uint8_t instruction, uint8_t longInstruction,
+                         int slot) {
+    if (slot <= UINT16_MAX) {
+        emitShortOp(instruction, (uint16_t)slot);
+    } else {
+        emitLongOp(longInstruction, slot);
+    }
+}
+
+// Emits a loop instruction. The distance back is counted from the end of
+// the instruction, so the long form has one more byte to cover.
+static void emitLoop(int loopStart) {
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset <= UINT16_MAX) {
+        emitShortOp(OP_LOOP, (uint16_t)offset);
+        return;
+    }
+
+    offset++;
+    if (offset > OPERAND_LONG_MAX) error("Loop body too large.");
+    emitLongOp(OP_LOOP_LONG, offset);
 }
 
 // Emits a jump instruction and returns its location for later patching.
@@ -194,19 +267,21 @@ static void emitReturn() {
 }
 
 // Creates a constant in the chunk and returns its index.
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    WRITE_BARRIER(current->function);
+    if (constant > OPERAND_LONG_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
 }
 
-// Emits an OP_CONSTANT instruction.
+// Emits an OP_CONSTANT instruction, or OP_CONSTANT_LONG past the first 256
+// constants.
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitOperandOp(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
 }
 
 // Patches a jump instruction at a given location to jump to the current position.
@@ -214,12 +289,90 @@ static void patchJump(int offset) {
     // -2 to adjust for the bytecode for the jump offset itself.
     int jump = currentChunk()->count - offset - 2;
 
-    if (jump > UINT16_MAX) {
+    if (jump > OPERAND_LONG_MAX) {
         error("Too much code to jump over.");
+    } else if (jump > UINT16_MAX) {
+        // The peephole pass rewrites it as a _LONG jump.
+        if (current->farJumpCount == current->farJumpCapacity) {
+            current->farJumpCapacity = GROW_CAPACITY(current->farJumpCapacity);
+            current->farJumps = realloc(current->farJumps,
+                sizeof(FarJump) * current->farJumpCapacity);
+            if (current->farJumps == NULL) {
+                fprintf(stderr, "Not enough memory to compile.\n");
+                exit(1);
+            }
+        }
+        FarJump* far = &current->farJumps[current->farJumpCount++];
+        far->offset = offset - 1;
+        far->target = currentChunk()->count;
+    } else {
+        currentChunk()->code[offset] = (jump >> 8) & 0xff;
+        currentChunk()->code[offset + 1] = jump & 0xff;
+    }
+    current->lastJumpTarget = currentChunk()->count;
+}
+
+// Adds a slot to the current function's locals and returns it, or NULL if
+// the function has as many as the _LONG instructions can address.
+static Local* pushLocal() {
+    if (current->localCount > OPERAND_LONG_MAX) return NULL;
+    if (current->localCount == current->localCapacity) {
+        current->localCapacity = GROW_CAPACITY(current->localCapacity);
+        current->locals = realloc(current->locals,
+            sizeof(Local) * current->localCapacity);
+        if (current->locals == NULL) {
+            fprintf(stderr, "Not enough memory to compile.\n");
+            exit(1);
+        }
     }
+    return &current->locals[current->localCount++];
+}
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+// Returns the offset of the last instruction if it is an OP_CONSTANT that
+// pushes a number and makes up the whole of the operand just compiled, or
+// -1. A jump landing after it means it is only one branch of an and/or.
+static int lastNumberConstant() {
+    Chunk* chunk = currentChunk();
+    int offset = current->lastOpcode;
+    if (offset == -1 || offset != chunk->count - 2 ||
+        chunk->code[offset] != OP_CONSTANT ||
+        current->lastJumpTarget == chunk->count) {
+        return -1;
+    }
+    if (!IS_NUMBER(chunk->constants.values[chunk->code[offset + 1]])) return -1;
+    return offset;
+}
+
+// Replaces two number constants at leftOffset, the operands of a binary
+// operator, with their result. Returns false if the right operand is not a
+// constant or the result must be left to the VM, like division by zero.
+static bool foldBinary(TokenType operatorType, int leftOffset) {
+    Chunk* chunk = currentChunk();
+    if (lastNumberConstant() != leftOffset + 2) return false;
+
+    int left = chunk->code[leftOffset + 1];
+    int right = chunk->code[leftOffset + 3];
+    double a = AS_NUMBER(chunk->constants.values[left]);
+    double b = AS_NUMBER(chunk->constants.values[right]);
+    double result;
+    switch (operatorType) {
+        case TOKEN_PLUS:  result = a + b; break;
+        case TOKEN_MINUS: result = a - b; break;
+        case TOKEN_STAR:  result = a * b; break;
+        case TOKEN_SLASH:
+            if (b == 0.0) return false;
+            result = a / b;
+            break;
+        default: return false;
+    }
+
+    // The operands' constants were the last two added, so they can go too.
+    if (right == chunk->constants.count - 1) chunk->constants.count--;
+    if (left == chunk->constants.count - 1) chunk->constants.count--;
+    chunk->count = leftOffset;
+    adjustStack(-2);
+    emitConstant(NUMBER_VAL(result));
+    return true;
 }
 
 // Initializes a new compiler.
@@ -227,34 +380,416 @@ static void initCompiler(Compiler* compiler, FunctionType type, ObjModule* modul
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
     compiler->scopeDepth = 0;
+    compiler->farJumps = NULL;
+    compiler->farJumpCount = 0;
+    compiler->farJumpCapacity = 0;
+    compiler->stackDepth = 0;
+    compiler->operandBytes = 0;
+    compiler->lastOpcode = -1;
+    compiler->lastJumpTarget = -1;
     compiler->function = newFunction();
     compiler->function->module = module;
     current = compiler;
 
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
+        WRITE_BARRIER(current->function);
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = pushLocal();
     local->depth = 0;
     local->name.start = "";
     local->name.length = 0;
+    adjustStack(1); // Slot zero holds the function being called.
+}
+
+// Returns where a jump's distance sits within the instruction, or 0 if op
+// is not a jump. The distance takes two bytes, or three in the _LONG forms.
+static int jumpOperand(uint8_t op) {
+    switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_JUMP_IF_FALSE_POP:
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+            return 1;
+        case OP_LESS_LOCAL_LOCAL_JUMP:
+        case OP_LESS_LOCAL_CONST_JUMP:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+static bool isLongJump(uint8_t op) {
+    return op == OP_JUMP_LONG || op == OP_JUMP_IF_FALSE_LONG ||
+           op == OP_LOOP_LONG;
+}
+
+static bool isLoop(uint8_t op) {
+    return op == OP_LOOP || op == OP_LOOP_LONG;
 }
 
+// Returns the offset a jump instruction at offset lands on. Distances are
+// measured from the end of the instruction.
+static int jumpTarget(uint8_t* code, int offset) {
+    uint8_t* operand = &code[offset + jumpOperand(code[offset])];
+    int distance = (operand[0] << 8) | operand[1];
+    if (isLongJump(code[offset])) distance = (distance << 8) | operand[2];
+    int next = offset + 1 + opInfo[code[offset]].operandBytes;
+    return isLoop(code[offset]) ? next - distance : next + distance;
+}
+
+// State of the peephole pass over one chunk. Arrays indexed by offset are
+// in terms of the code the compiler emitted.
+typedef struct {
+    Chunk* chunk;
+    int* jumpTo;    // Where the jump at an offset lands.
+    int* targets;   // How many jumps land on an offset.
+    bool* starts;   // Whether an instruction starts at an offset.
+    bool* wide;     // Jumps that must take the _LONG form.
+    bool* dropped;  // POPs folded into the jump that reaches them.
+    int* moved;     // Where an offset ended up in the new code.
+    uint8_t* code;
+    int* lines;
+    // New offset and emitted offset of each jump in the new code, patched
+    // once the layout is done.
+    int* jumps;
+    int* jumpSources;
+    int jumpCount;
+} Peephole;
+
+// Returns true if the instructions from offset on are the opcodes in ops,
+// in order, and no jump lands inside them. Fills at[0..length] with the
+// offset of each instruction and of the one after the last.
+static bool matchSequence(Peephole* pass, int offset, const uint8_t* ops,
+                          int length, int* at) {
+    Chunk* chunk = pass->chunk;
+    for (int i = 0; i < length; i++) {
+        if (offset >= chunk->count || chunk->code[offset] != ops[i]) {
+            return false;
+        }
+        if (i > 0 && pass->targets[offset] != 0) return false;
+        at[i] = offset;
+        offset += 1 + opInfo[ops[i]].operandBytes;
+    }
+    at[length] = offset;
+    return true;
+}
+
+// Returns true if the OP_JUMP_IF_FALSE at offset, which is followed by an
+// OP_POP, can pop the condition itself: it stays short, its target is an
+// OP_POP that only this jump reaches, and the code before the target jumps
+// away rather than falling into it. That is the shape if, while and for
+// conditions compile to.
+static bool popsAtTarget(Peephole* pass, int offset) {
+    uint8_t* code = pass->chunk->code;
+    int target = pass->jumpTo[offset];
+    if (pass->wide[offset] || target >= pass->chunk->count ||
+        code[target] != OP_POP || pass->targets[target] != 1) {
+        return false;
+    }
+    int last = target - 3;
+    if (last > offset && pass->starts[last] &&
+        (code[last] == OP_JUMP || code[last] == OP_LOOP)) {
+        return true;
+    }
+    last = target - 4;
+    return last > offset && pass->starts[last] &&
+           (code[last] == OP_JUMP_LONG || code[last] == OP_LOOP_LONG);
+}
+
+static bool isNumberConstant(Chunk* chunk, uint8_t constant) {
+    return IS_NUMBER(chunk->constants.values[constant]);
+}
+
+// Instruction sequences fused into superinstructions. The for-loop ones
+// were picked from the pair counts bench/op_pairs reports.
+static const uint8_t incLocal[] = {
+    OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP,
+};
+static const uint8_t lessLocalLocalJump[] = {
+    OP_GET_LOCAL, OP_GET_LOCAL, OP_LESS, OP_JUMP_IF_FALSE, OP_POP,
+};
+static const uint8_t lessLocalConstJump[] = {
+    OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE, OP_POP,
+};
+static const uint8_t addLocalConst[] = {OP_GET_LOCAL, OP_CONSTANT, OP_ADD};
+static const uint8_t subtractLocalConst[] = {
+    OP_GET_LOCAL, OP_CONSTANT, OP_SUBTRACT,
+};
+static const uint8_t addLocals[] = {OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD};
+static const uint8_t conditionJump[] = {OP_JUMP_IF_FALSE, OP_POP};
+
+#define MATCH(ops) matchSequence(pass, offset, ops, sizeof(ops), at)
+
+// Lays the chunk out again into pass->code with the sequences below fused
+// and the jumps in pass->wide in their _LONG form. Jump distances are left
+// for the caller to fill in. Returns the new length and sets *after to the
+// number of instructions.
+static int rewriteChunk(Peephole* pass, int* after) {
+    Chunk* chunk = pass->chunk;
+    int count = chunk->count;
+    uint8_t* code = pass->code;
+    memset(pass->dropped, 0, sizeof(bool) * (count + 1));
+    pass->jumpCount = 0;
+
+    int out = 0;
+    *after = 0;
+    for (int offset = 0; offset < count;) {
+        uint8_t* in = &chunk->code[offset];
+        int length = 1 + opInfo[in[0]].operandBytes;
+        int next = offset + length;
+        pass->moved[offset] = out;
+        if (pass->dropped[offset]) {
+            offset = next;
+            continue;
+        }
+
+        memcpy(&code[out], in, length);
+        int written = length;
+        // Where the jump whose target the new instruction keeps was.
+        int jumpFrom = offset;
+        int at[6];
+
+        if (MATCH(incLocal) && in[1] == chunk->code[at[3] + 1] &&
+            isNumberConstant(chunk, in[3])) {
+            code[out] = OP_INC_LOCAL;
+            code[out + 2] = in[3];
+            written = 3;
+            next = at[5];
+        } else if ((MATCH(lessLocalLocalJump) ||
+                    (MATCH(lessLocalConstJump) &&
+                     isNumberConstant(chunk, in[3]))) &&
+                   popsAtTarget(pass, at[3])) {
+            code[out] = in[2] == OP_GET_LOCAL ? OP_LESS_LOCAL_LOCAL_JUMP
+                                              : OP_LESS_LOCAL_CONST_JUMP;
+            code[out + 2] = in[3];
+            written = 5;
+            jumpFrom = at[3];
+            pass->dropped[pass->jumpTo[jumpFrom]] = true;
+            next = at[5];
+        } else if ((MATCH(addLocalConst) || MATCH(subtractLocalConst)) &&
+                   isNumberConstant(chunk, in[3])) {
+            code[out] = chunk->code[at[2]] == OP_ADD ? OP_ADD_LOCAL_CONST
+                                                     : OP_SUBTRACT_LOCAL_CONST;
+            code[out + 2] = in[3];
+            written = 3;
+            next = at[3];
+        } else if (MATCH(addLocals)) {
+            code[out] = OP_ADD_LOCALS;
+            code[out + 2] = in[3];
+            written = 3;
+            next = at[3];
+        } else if (next < count && pass->targets[next] == 0 &&
+                   in[length] == OP_NOT &&
+                   (in[0] == OP_EQUAL || in[0] == OP_GREATER ||
+                    in[0] == OP_LESS)) {
+            code[out] = in[0] == OP_EQUAL   ? OP_NOT_EQUAL
+                      : in[0] == OP_GREATER ? OP_LESS_EQUAL
+                                            : OP_GREATER_EQUAL;
+            next += 1;
+        } else if (MATCH(conditionJump) && popsAtTarget(pass, offset)) {
+            code[out] = OP_JUMP_IF_FALSE_POP;
+            pass->dropped[pass->jumpTo[offset]] = true;
+            next = at[2];
+        } else if (pass->wide[offset] && !isLongJump(in[0])) {
+            code[out] = in[0] == OP_JUMP   ? OP_JUMP_LONG
+                      : in[0] == OP_LOOP   ? OP_LOOP_LONG
+                                           : OP_JUMP_IF_FALSE_LONG;
+            written = 4;
+        }
+
+        for (int i = 0; i < written; i++) {
+            pass->lines[out + i] = chunk->lines[offset];
+        }
+        if (jumpOperand(code[out]) != 0) {
+            pass->jumps[pass->jumpCount] = out;
+            pass->jumpSources[pass->jumpCount++] = jumpFrom;
+        }
+        for (int i = offset + 1; i < next; i++) {
+            pass->moved[i] = out;
+        }
+        out += written;
+        (*after)++;
+        offset = next;
+    }
+    pass->moved[count] = out;
+    return out;
+}
+
+#undef MATCH
+
+// Fills in the jump distances after rewriteChunk(). Returns false if a
+// short jump turned out too far for its two bytes; it is then marked wide
+// and the chunk must be laid out again.
+static bool patchJumps(Peephole* pass) {
+    bool fits = true;
+    for (int i = 0; i < pass->jumpCount; i++) {
+        int from = pass->jumps[i];
+        uint8_t op = pass->code[from];
+        int to = pass->moved[pass->jumpTo[pass->jumpSources[i]]];
+        int end = from + 1 + opInfo[op].operandBytes;
+        int distance = isLoop(op) ? end - to : to - end;
+        uint8_t* operand = &pass->code[from + jumpOperand(op)];
+
+        if (isLongJump(op)) {
+            operand[0] = (distance >> 16) & 0xff;
+            operand[1] = (distance >> 8) & 0xff;
+            operand[2] = distance & 0xff;
+        } else if (distance > UINT16_MAX) {
+            pass->wide[pass->jumpSources[i]] = true;
+            fits = false;
+        } else {
+            operand[0] = (distance >> 8) & 0xff;
+            operand[1] = distance & 0xff;
+        }
+    }
+    return fits;
+}
+
+// Peephole pass over a finished chunk. It fuses common instruction
+// sequences into single instructions, where k is a number constant:
+//
+//   OP_EQUAL OP_NOT          -> OP_NOT_EQUAL
+//   OP_GREATER OP_NOT        -> OP_LESS_EQUAL
+//   OP_LESS OP_NOT           -> OP_GREATER_EQUAL
+//   OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD -> OP_ADD_LOCALS a b
+//   OP_GET_LOCAL a, OP_CONSTANT k, OP_ADD  -> OP_ADD_LOCAL_CONST a k
+//   OP_GET_LOCAL a, OP_CONSTANT k, OP_SUBTRACT
+//                            -> OP_SUBTRACT_LOCAL_CONST a k
+//   OP_GET_LOCAL a, OP_CONSTANT k, OP_ADD, OP_SET_LOCAL a, OP_POP
+//                            -> OP_INC_LOCAL a k
+//   OP_JUMP_IF_FALSE t, OP_POP ... t: OP_POP -> OP_JUMP_IF_FALSE_POP t+1
+//   OP_GET_LOCAL a, OP_GET_LOCAL b, OP_LESS, OP_JUMP_IF_FALSE t, OP_POP
+//                            -> OP_LESS_LOCAL_LOCAL_JUMP a b t+1
+//   OP_GET_LOCAL a, OP_CONSTANT k, OP_LESS, OP_JUMP_IF_FALSE t, OP_POP
+//                            -> OP_LESS_LOCAL_CONST_JUMP a k t+1
+//
+// A sequence is only fused if no jump lands inside it. The jumps that pop
+// their condition apply only where popsAtTarget() allows, and drop the POP
+// at the target.
+//
+// It is also where jumps get their final width. The far jumps the compiler
+// could not patch, given as offset and target pairs, become _LONG jumps,
+// and so does any short jump that ends up too far once the code is laid
+// out, which may take a few rounds. Returns the number of instructions
+// before and after through the out parameters.
+static void optimizeChunk(Chunk* chunk, FarJump* farJumps, int farJumpCount,
+                          int* before, int* after) {
+    int count = chunk->count;
+    // A short jump grows by a byte when widened, and takes at least three.
+    int limit = count + count / 3 + 1;
+    Peephole pass;
+    pass.chunk = chunk;
+    pass.jumpTo = malloc(sizeof(int) * (count + 1));
+    pass.targets = calloc(count + 1, sizeof(int));
+    pass.starts = calloc(count + 1, sizeof(bool));
+    pass.wide = calloc(count + 1, sizeof(bool));
+    pass.dropped = malloc(sizeof(bool) * (count + 1));
+    pass.moved = malloc(sizeof(int) * (count + 1));
+    pass.code = malloc(limit);
+    pass.lines = malloc(sizeof(int) * limit);
+    pass.jumps = malloc(sizeof(int) * count);
+    pass.jumpSources = malloc(sizeof(int) * count);
+    if (pass.jumpTo == NULL || pass.targets == NULL || pass.starts == NULL ||
+        pass.wide == NULL || pass.dropped == NULL || pass.moved == NULL ||
+        pass.code == NULL || pass.lines == NULL || pass.jumps == NULL ||
+        pass.jumpSources == NULL) {
+        fprintf(stderr, "Not enough memory to optimize bytecode.\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < farJumpCount; i++) {
+        pass.jumpTo[farJumps[i].offset] = farJumps[i].target;
+        pass.wide[farJumps[i].offset] = true;
+    }
+
+    *before = 0;
+    for (int offset = 0; offset < count;
+         offset += 1 + opInfo[chunk->code[offset]].operandBytes) {
+        uint8_t op = chunk->code[offset];
+        pass.starts[offset] = true;
+        (*before)++;
+        if (jumpOperand(op) == 0) continue;
+        if (isLongJump(op)) {
+            pass.wide[offset] = true;
+        }
+        if (!pass.wide[offset] || isLongJump(op)) {
+            pass.jumpTo[offset] = jumpTarget(chunk->code, offset);
+        }
+        pass.targets[pass.jumpTo[offset]]++;
+    }
+
+    int out;
+    do {
+        out = rewriteChunk(&pass, after);
+    } while (!patchJumps(&pass));
+
+    if (out > chunk->capacity) {
+        int oldCapacity = chunk->capacity;
+        chunk->capacity = out;
+        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, out);
+        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, out);
+    }
+    memcpy(chunk->code, pass.code, out);
+    memcpy(chunk->lines, pass.lines, sizeof(int) * out);
+    chunk->count = out;
+
+    free(pass.jumpTo);
+    free(pass.targets);
+    free(pass.starts);
+    free(pass.wide);
+    free(pass.dropped);
+    free(pass.moved);
+    free(pass.code);
+    free(pass.lines);
+    free(pass.jumps);
+    free(pass.jumpSources);
+}
+
+#ifdef FLS_OP_PAIRS
+// Adds a finished chunk's instructions to compiledOps.
+static void countCompiledOps(Chunk* chunk) {
+    int previous = -1;
+    for (int offset = 0; offset < chunk->count;
+         offset += 1 + opInfo[chunk->code[offset]].operandBytes) {
+        uint8_t op = chunk->code[offset];
+        compiledOps.ops[op]++;
+        if (previous != -1) compiledOps.pairs[previous][op]++;
+        previous = op;
+    }
+}
+#endif
+
 // Finishes compilation and returns the compiled function.
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
 
-#ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
-        disassembleChunk(currentChunk(), function->name != NULL
-            ? function->name->chars : "<script>");
-    }
+        int before, after;
+        optimizeChunk(currentChunk(), current->farJumps,
+                      current->farJumpCount, &before, &after);
+#ifdef FLS_OP_PAIRS
+        countCompiledOps(currentChunk());
 #endif
+#ifdef DEBUG_PRINT_CODE
+        const char* name = function->name != NULL
+            ? function->name->chars : "<script>";
+        disassembleChunk(currentChunk(), name);
+        printInstructionCounts(name, before, after);
+#endif
+    }
 
+    free(current->locals);
+    free(current->farJumps);
     current = current->enclosing;
     return function;
 }
@@ -292,8 +827,11 @@ static void parsePrecedence(Precedence precedence);
 static void binary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
     ParseRule* rule = getRule(operatorType);
+    int leftConstant = lastNumberConstant();
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    if (leftConstant != -1 && foldBinary(operatorType, leftConstant)) return;
+
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
         case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
@@ -329,6 +867,7 @@ static uint8_t argumentList() {
 static void call(bool canAssign) {
     uint8_t argCount = argumentList();
     emitBytes(OP_CALL, argCount);
+    adjustStack(-argCount);
 }
 
 static void list(bool canAssign) {
@@ -416,18 +955,28 @@ static int resolveLocal(Compiler* compiler, Token* name) {
 }
 
 // Parses a variable name and adds it as a constant.
-static uint8_t identifierConstant(Token* name) {
+static int identifierConstant(Token* name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+// Resolves a global variable to its slot in the VM's global array.
+static int globalVariable(Token* name) {
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > OPERAND_LONG_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return slot;
+}
+
 // Adds a local variable to the compiler's list.
 static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
+    Local* local = pushLocal();
+    if (local == NULL) {
         error("Too many local variables in function.");
         return;
     }
 
-    Local* local = &current->locals[current->localCount++];
     local->name = name;
     local->depth = -1; // Mark as uninitialized
 }
@@ -451,14 +1000,14 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-// Parses a variable name.
-static uint8_t parseVariable(const char* errorMessage) {
+// Parses a variable name, returning its global slot at top level.
+static int parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
 // Marks the last declared local variable as initialized.
@@ -468,33 +1017,73 @@ static void markInitialized() {
 }
 
 // Defines a variable by emitting the appropriate instruction.
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobalOp(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
+}
+
+// Calls to these list natives through their global names compile to a
+// dedicated instruction in place of OP_CALL. The callee is still pushed so
+// the instruction can fall back to a real call if the global was redefined.
+typedef struct {
+    const char* name;
+    int length;
+    int arity;
+    OpCode op;
+} ListIntrinsic;
+
+static const ListIntrinsic listIntrinsics[] = {
+    {"listGet", 7, 2, OP_LIST_GET},
+    {"listSet", 7, 3, OP_LIST_SET},
+    {"listLen", 7, 1, OP_LIST_LEN},
+};
+
+static const ListIntrinsic* findListIntrinsic(Token* name) {
+    for (size_t i = 0; i < sizeof(listIntrinsics) / sizeof(listIntrinsics[0]); i++) {
+        const ListIntrinsic* intrinsic = &listIntrinsics[i];
+        if (name->length == intrinsic->length &&
+            memcmp(name->start, intrinsic->name, intrinsic->length) == 0) {
+            return intrinsic;
+        }
+    }
+    return NULL;
 }
 
 // Parses a variable expression.
 static void namedVariable(Token name, bool canAssign) {
-    uint8_t getOp, setOp;
     int arg = resolveLocal(current, &name);
     if (arg != -1) {
-        getOp = OP_GET_LOCAL;
-        setOp = OP_SET_LOCAL;
-    } else {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        if (canAssign && match(TOKEN_EQUAL)) {
+            expression();
+            emitOperandOp(OP_SET_LOCAL, OP_SET_LOCAL_LONG, arg);
+        } else {
+            emitOperandOp(OP_GET_LOCAL, OP_GET_LOCAL_LONG, arg);
+        }
+        return;
     }
 
+    int slot = globalVariable(&name);
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
-    } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitGlobalOp(OP_SET_GLOBAL, OP_SET_GLOBAL_LONG, slot);
+        return;
+    }
+
+    emitGlobalOp(OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, slot);
+
+    const ListIntrinsic* intrinsic = findListIntrinsic(&name);
+    if (intrinsic != NULL && match(TOKEN_LPAREN)) {
+        uint8_t argCount = argumentList();
+        if (argCount == intrinsic->arity) {
+            emitByte(intrinsic->op);
+        } else {
+            emitBytes(OP_CALL, argCount);
+            adjustStack(-argCount);
+        }
     }
 }
 
@@ -509,6 +1098,14 @@ static void unary(bool canAssign) {
     // Compile the operand.
     parsePrecedence(PREC_UNARY);
 
+    // Negating a number literal just negates the constant.
+    int constant = lastNumberConstant();
+    if (operatorType == TOKEN_MINUS && constant != -1) {
+        Value* value = &currentChunk()->constants.values[currentChunk()->code[constant + 1]];
+        *value = NUMBER_VAL(-AS_NUMBER(*value));
+        return;
+    }
+
     // Emit the operator instruction.
     switch (operatorType) {
         case TOKEN_BANG: emitByte(OP_NOT); break;
@@ -628,8 +1225,9 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            int constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
+            adjustStack(1); // Arguments are pushed by the caller.
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RPAREN, "Expect ')' after parameters.");
@@ -637,7 +1235,7 @@ static void function(FunctionType type) {
     block();
 
     ObjFunction* function = endCompiler();
-    emitBytes(OP_CONSTANT, makeConstant(OBJ_VAL(function)));
+    emitConstant(OBJ_VAL(function));
 }
 
 // Parses a top-level function declaration.
@@ -651,20 +1249,22 @@ static void importStatement() {
 }
 
 static void funDeclaration(bool isExport) {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
+    Token name = parser.previous;
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
 
     if (isExport) {
-        emitBytes(OP_EXPORT, global);
+        emitOperandOp(OP_EXPORT, OP_EXPORT_LONG, identifierConstant(&name));
     }
 }
 
 // ...
 
 static void varDeclaration(bool isExport) {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
+    Token name = parser.previous;
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -676,7 +1276,7 @@ static void varDeclaration(bool isExport) {
     defineVariable(global);
 
     if (isExport) {
-        emitBytes(OP_EXPORT, global);
+        emitOperandOp(OP_EXPORT, OP_EXPORT_LONG, identifierConstant(&name));
     }
 }
 
@@ -726,6 +1326,7 @@ static void forStatement() {
     emitLoop(loopStart);
 
     if (exitJump != -1) {
+        adjustStack(1); // The exit path still has the condition on the stack.
         patchJump(exitJump);
         emitByte(OP_POP); // Condition.
     }
@@ -744,6 +1345,7 @@ static void ifStatement() {
     statement();
 
     int elseJump = emitJump(OP_JUMP);
+    adjustStack(1); // The else path still has the condition on the stack.
 
     patchJump(thenJump);
     emitByte(OP_POP);
@@ -766,6 +1368,14 @@ static void returnStatement() {
     } else {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+        // A call whose result is returned straight away becomes a tail
+        // call. A jump may still land after it, so OP_RETURN stays.
+        Chunk* chunk = currentChunk();
+        if (current->lastOpcode != -1 &&
+            chunk->code[current->lastOpcode] == OP_CALL) {
+            chunk->code[current->lastOpcode] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
@@ -781,6 +1391,7 @@ static void whileStatement() {
     emitByte(OP_POP);
     statement();
     emitLoop(loopStart);
+    adjustStack(1); // The exit path still has the condition on the stack.
 
     patchJump(exitJump);
     emitByte(OP_POP);
@@ -878,3 +1489,11 @@ ObjFunction* compile(const char* source, ObjModule* module) {
     ObjFunction* function = endCompiler();
     return parser.hadError ? NULL : function;
 }
+
+void markCompilerRoots() {
+    Compiler* compiler = current;
+    while (compiler != NULL) {
+        markObject((Obj*)compiler->function);
+        compiler = compiler->enclosing;
+    }
+}
@@ -3,6 +3,79 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "vm.h"
+
+#ifdef FLS_OP_PAIRS
+OpCounts executedOps;
+OpCounts compiledOps;
+#endif
+
+static const char* opcodeNames[] = {
+    [OP_CONSTANT]              = "OP_CONSTANT",
+    [OP_CONSTANT_LONG]         = "OP_CONSTANT_LONG",
+    [OP_NIL]                   = "OP_NIL",
+    [OP_TRUE]                  = "OP_TRUE",
+    [OP_FALSE]                 = "OP_FALSE",
+    [OP_POP]                   = "OP_POP",
+    [OP_GET_LOCAL]             = "OP_GET_LOCAL",
+    [OP_GET_LOCAL_LONG]        = "OP_GET_LOCAL_LONG",
+    [OP_SET_LOCAL]             = "OP_SET_LOCAL",
+    [OP_SET_LOCAL_LONG]        = "OP_SET_LOCAL_LONG",
+    [OP_GET_GLOBAL]            = "OP_GET_GLOBAL",
+    [OP_GET_GLOBAL_LONG]       = "OP_GET_GLOBAL_LONG",
+    [OP_DEFINE_GLOBAL]         = "OP_DEFINE_GLOBAL",
+    [OP_DEFINE_GLOBAL_LONG]    = "OP_DEFINE_GLOBAL_LONG",
+    [OP_SET_GLOBAL]            = "OP_SET_GLOBAL",
+    [OP_SET_GLOBAL_LONG]       = "OP_SET_GLOBAL_LONG",
+    [OP_GET_PROPERTY]          = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY]          = "OP_SET_PROPERTY",
+    [OP_EXPORT_VAR]            = "OP_EXPORT_VAR",
+    [OP_EQUAL]                 = "OP_EQUAL",
+    [OP_NOT_EQUAL]             = "OP_NOT_EQUAL",
+    [OP_GREATER]               = "OP_GREATER",
+    [OP_GREATER_EQUAL]         = "OP_GREATER_EQUAL",
+    [OP_LESS]                  = "OP_LESS",
+    [OP_LESS_EQUAL]            = "OP_LESS_EQUAL",
+    [OP_ADD]                   = "OP_ADD",
+    [OP_ADD_LOCALS]            = "OP_ADD_LOCALS",
+    [OP_ADD_LOCAL_CONST]       = "OP_ADD_LOCAL_CONST",
+    [OP_INC_LOCAL]             = "OP_INC_LOCAL",
+    [OP_SUBTRACT]              = "OP_SUBTRACT",
+    [OP_SUBTRACT_LOCAL_CONST]  = "OP_SUBTRACT_LOCAL_CONST",
+    [OP_MULTIPLY]              = "OP_MULTIPLY",
+    [OP_DIVIDE]                = "OP_DIVIDE",
+    [OP_MODULO]                = "OP_MODULO",
+    [OP_NOT]                   = "OP_NOT",
+    [OP_NEGATE]                = "OP_NEGATE",
+    [OP_PRINT]                 = "OP_PRINT",
+    [OP_JUMP]                  = "OP_JUMP",
+    [OP_JUMP_LONG]             = "OP_JUMP_LONG",
+    [OP_JUMP_IF_FALSE]         = "OP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_FALSE_LONG]    = "OP_JUMP_IF_FALSE_LONG",
+    [OP_JUMP_IF_FALSE_POP]     = "OP_JUMP_IF_FALSE_POP",
+    [OP_LESS_LOCAL_LOCAL_JUMP] = "OP_LESS_LOCAL_LOCAL_JUMP",
+    [OP_LESS_LOCAL_CONST_JUMP] = "OP_LESS_LOCAL_CONST_JUMP",
+    [OP_LOOP]                  = "OP_LOOP",
+    [OP_LOOP_LONG]             = "OP_LOOP_LONG",
+    [OP_CALL]                  = "OP_CALL",
+    [OP_TAIL_CALL]             = "OP_TAIL_CALL",
+    [OP_NEW_LIST]              = "OP_NEW_LIST",
+    [OP_LIST_APPEND]           = "OP_LIST_APPEND",
+    [OP_GET_SUBSCRIPT]         = "OP_GET_SUBSCRIPT",
+    [OP_SET_SUBSCRIPT]         = "OP_SET_SUBSCRIPT",
+    [OP_LIST_GET]              = "OP_LIST_GET",
+    [OP_LIST_SET]              = "OP_LIST_SET",
+    [OP_LIST_LEN]              = "OP_LIST_LEN",
+    [OP_RETURN]                = "OP_RETURN",
+    [OP_IMPORT]                = "OP_IMPORT",
+    [OP_EXPORT]                = "OP_EXPORT",
+    [OP_EXPORT_LONG]           = "OP_EXPORT_LONG",
+};
+
+const char* opcodeName(uint8_t op) {
+    if (op >= sizeof(opcodeNames) / sizeof(opcodeNames[0])) return NULL;
+    return opcodeNames[op];
+}
 
 // Disassembles all instructions in a chunk.
 void disassembleChunk(Chunk* chunk, const char* name) {
@@ -13,6 +86,12 @@ void disassembleChunk(Chunk* chunk, const char* name) {
     }
 }
 
+// Prints how many instructions the peephole pass left in a chunk.
+void printInstructionCounts(const char* name, int before, int after) {
+    printf("== %s: %d instructions, %d after peephole ==\n", name, before,
+           after);
+}
+
 // Prints a constant instruction.
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
@@ -22,6 +101,41 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+// Reads the three-byte operand of a _LONG instruction.
+static int readLong(Chunk* chunk, int offset) {
+    return (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) |
+           chunk->code[offset + 3];
+}
+
+// Prints a constant instruction with a three-byte index.
+static int constantLongInstruction(const char* name, Chunk* chunk,
+                                   int offset) {
+    int constant = readLong(chunk, offset);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+// Prints a global variable instruction with its slot and name.
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
+// Prints a global variable instruction with a three-byte slot.
+static int globalLongInstruction(const char* name, Chunk* chunk, int offset) {
+    int slot = readLong(chunk, offset);
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 4;
+}
+
 // Prints a simple instruction with no operands.
 static int simpleInstruction(const char* name, int offset) {
     printf("%s\n", name);
@@ -35,6 +149,46 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2; 
 }
 
+// Prints a local variable instruction with a three-byte slot.
+static int longInstruction(const char* name, Chunk* chunk, int offset) {
+    printf("%-16s %4d\n", name, readLong(chunk, offset));
+    return offset + 4;
+}
+
+// Prints an instruction with two local slot operands.
+static int localPairInstruction(const char* name, Chunk* chunk, int offset) {
+    printf("%-16s %4d %4d\n", name, chunk->code[offset + 1],
+           chunk->code[offset + 2]);
+    return offset + 3;
+}
+
+// Prints an instruction with a local slot and a constant operand.
+static int localConstantInstruction(const char* name, Chunk* chunk,
+                                    int offset) {
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, chunk->code[offset + 1], constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+// Prints a compare-and-jump instruction: two operands, then the jump. The
+// second operand is a local slot or, with constant, a constant.
+static int compareJumpInstruction(const char* name, bool constant,
+                                  Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+    jump |= chunk->code[offset + 4];
+    printf("%-16s %4d %4d", name, chunk->code[offset + 1],
+           chunk->code[offset + 2]);
+    if (constant) {
+        printf(" '");
+        printValue(chunk->constants.values[chunk->code[offset + 2]]);
+        printf("'");
+    }
+    printf(" %4d -> %d\n", offset, offset + 5 + jump);
+    return offset + 5;
+}
+
 // Prints a jump instruction.
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -44,19 +198,30 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+// Prints a jump instruction with a three-byte distance.
+static int longJumpInstruction(const char* name, int sign, Chunk* chunk,
+                               int offset) {
+    printf("%-16s %4d -> %d\n", name, offset,
+           offset + 4 + sign * readLong(chunk, offset));
+    return offset + 4;
+}
+
 // Disassembles a single instruction.
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
         case OP_NIL:
             return simpleInstruction("OP_NIL", offset);
         case OP_TRUE:
@@ -67,24 +232,49 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_POP", offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return longInstruction("OP_GET_LOCAL_LONG", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return longInstruction("OP_SET_LOCAL_LONG", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return globalLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return globalLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return globalLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
         case OP_GREATER:
             return simpleInstruction("OP_GREATER", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
         case OP_LESS:
             return simpleInstruction("OP_LESS", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
         case OP_ADD:
             return simpleInstruction("OP_ADD", offset);
+        case OP_ADD_LOCALS:
+            return localPairInstruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_ADD_LOCAL_CONST:
+            return localConstantInstruction("OP_ADD_LOCAL_CONST", chunk, offset);
+        case OP_INC_LOCAL:
+            return localConstantInstruction("OP_INC_LOCAL", chunk, offset);
         case OP_SUBTRACT:
             return simpleInstruction("OP_SUBTRACT", offset);
+        case OP_SUBTRACT_LOCAL_CONST:
+            return localConstantInstruction("OP_SUBTRACT_LOCAL_CONST", chunk,
+                                            offset);
         case OP_MULTIPLY:
             return simpleInstruction("OP_MULTIPLY", offset);
         case OP_DIVIDE:
@@ -98,14 +288,49 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 
         case OP_JUMP:
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
+        case OP_JUMP_LONG:
+            return longJumpInstruction("OP_JUMP_LONG", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE_LONG:
+            return longJumpInstruction("OP_JUMP_IF_FALSE_LONG", 1, chunk,
+                                       offset);
+        case OP_JUMP_IF_FALSE_POP:
+            return jumpInstruction("OP_JUMP_IF_FALSE_POP", 1, chunk, offset);
+        case OP_LESS_LOCAL_LOCAL_JUMP:
+            return compareJumpInstruction("OP_LESS_LOCAL_LOCAL_JUMP", false,
+                                          chunk, offset);
+        case OP_LESS_LOCAL_CONST_JUMP:
+            return compareJumpInstruction("OP_LESS_LOCAL_CONST_JUMP", true,
+                                          chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_LOOP_LONG:
+            return longJumpInstruction("OP_LOOP_LONG", -1, chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_NEW_LIST:
+            return simpleInstruction("OP_NEW_LIST", offset);
+        case OP_LIST_APPEND:
+            return simpleInstruction("OP_LIST_APPEND", offset);
+        case OP_GET_SUBSCRIPT:
+            return simpleInstruction("OP_GET_SUBSCRIPT", offset);
+        case OP_SET_SUBSCRIPT:
+            return simpleInstruction("OP_SET_SUBSCRIPT", offset);
+        case OP_LIST_GET:
+            return simpleInstruction("OP_LIST_GET", offset);
+        case OP_LIST_SET:
+            return simpleInstruction("OP_LIST_SET", offset);
+        case OP_LIST_LEN:
+            return simpleInstruction("OP_LIST_LEN", offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_EXPORT:
+            return constantInstruction("OP_EXPORT", chunk, offset);
+        case OP_EXPORT_LONG:
+            return constantLongInstruction("OP_EXPORT_LONG", chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -27,6 +27,9 @@ void reportError(bool isCompileError, const char* moduleName, int line, const ch
     fprintf(stderr, " Here%s\n", ANSI_COLOR_RESET);
 }
 
+// Frames shown at each end of a runtime error's stack trace.
+#define TRACE_FRAMES 16
+
 void runtimeError(const char* format, ...) {
     char message[1024];
     va_list args;
@@ -37,7 +40,7 @@ void runtimeError(const char* format, ...) {
     CallFrame* frame = &vm.frames[vm.frameCount - 1];
     ObjFunction* function = frame->function;
     size_t instruction = frame->ip - function->chunk.code - 1;
-    int line = function->chunk.lines[instruction];
+    int line = getLine(&function->chunk, (int)instruction);
 
     // Open the source file to get the line content
     FILE* file = fopen(function->module->name->chars, "r");
@@ -63,12 +66,18 @@ void runtimeError(const char* format, ...) {
         fclose(file);
     }
 
-    // Print the stack trace
+    // Print the stack trace. Deep recursion keeps only the innermost and
+    // outermost frames.
     for (int i = vm.frameCount - 1; i >= 0; i--) {
+        if (i == vm.frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+            fprintf(stderr, "... %d more frames ...\n", i - TRACE_FRAMES + 1);
+            i = TRACE_FRAMES - 1;
+        }
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf(stderr, "[line %d] in ",
+                getLine(&function->chunk, (int)instruction));
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
@@ -76,5 +85,6 @@ void runtimeError(const char* format, ...) {
         }
     }
 
+    vm.hadError = true;
     resetStack();
 }
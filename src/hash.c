@@ -0,0 +1,186 @@
+#include <stddef.h>
+
+#include "hash.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FLS_HASH_X86
+#include <immintrin.h>
+#endif
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+#define LANE_PRIME 0x9E3779B1u
+#define MIX_PRIME 0x85EBCA77u
+#define LANE_COUNT 8
+#define BLOCK_SIZE (LANE_COUNT * 4)
+
+// Each lane starts from a different seed so that identical words in
+// different lanes do not cancel out.
+#define LANE_SEED(i) (FNV_OFFSET + (uint32_t)(i) * LANE_PRIME)
+
+uint32_t hashFnv1a(const char* key, int length) {
+    uint32_t hash = FNV_OFFSET;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static inline uint32_t rotl32(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+// Folds the lanes together, hashes the tail that did not fill a block and
+// mixes the result so that the low bits used for table indexing depend on
+// every input bit.
+static uint32_t finishBlocks(const uint32_t* lanes, const char* tail,
+                             int tailLength, int length) {
+    uint32_t hash = FNV_OFFSET ^ ((uint32_t)length * MIX_PRIME);
+    for (int i = 0; i < LANE_COUNT; i++) {
+        hash = rotl32(hash ^ lanes[i], 13) * LANE_PRIME;
+    }
+    for (int i = 0; i < tailLength; i++) {
+        hash ^= (uint8_t)tail[i];
+        hash *= FNV_PRIME;
+    }
+
+    hash ^= hash >> 16;
+    hash *= MIX_PRIME;
+    hash ^= hash >> 13;
+    hash *= LANE_PRIME;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static inline uint32_t readWord(const char* p) {
+    const uint8_t* bytes = (const uint8_t*)p;
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+           ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+// The portable reference for the block hash. Every 32-byte block updates
+// each lane with lane = rotl(lane ^ word, 15) * LANE_PRIME.
+static uint32_t hashBlocksScalar(const char* key, int length) {
+    uint32_t lanes[LANE_COUNT];
+    for (int i = 0; i < LANE_COUNT; i++) lanes[i] = LANE_SEED(i);
+
+    int blocks = length / BLOCK_SIZE;
+    for (int b = 0; b < blocks; b++) {
+        const char* block = key + b * BLOCK_SIZE;
+        for (int i = 0; i < LANE_COUNT; i++) {
+            lanes[i] = rotl32(lanes[i] ^ readWord(block + i * 4), 15) * LANE_PRIME;
+        }
+    }
+
+    int done = blocks * BLOCK_SIZE;
+    return finishBlocks(lanes, key + done, length - done, length);
+}
+
+#ifdef FLS_HASH_X86
+
+// SSE2 has no 32-bit low multiply, so it is built from two widening
+// multiplies of the even and odd lanes.
+__attribute__((target("sse2")))
+static inline __m128i mulLo32Sse2(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i laneStepSse2(__m128i lanes, __m128i words, __m128i prime) {
+    __m128i x = _mm_xor_si128(lanes, words);
+    x = _mm_or_si128(_mm_slli_epi32(x, 15), _mm_srli_epi32(x, 17));
+    return mulLo32Sse2(x, prime);
+}
+
+__attribute__((target("sse2")))
+static uint32_t hashBlocksSse2(const char* key, int length) {
+    __m128i low = _mm_setr_epi32((int)LANE_SEED(0), (int)LANE_SEED(1),
+                                 (int)LANE_SEED(2), (int)LANE_SEED(3));
+    __m128i high = _mm_setr_epi32((int)LANE_SEED(4), (int)LANE_SEED(5),
+                                  (int)LANE_SEED(6), (int)LANE_SEED(7));
+    const __m128i prime = _mm_set1_epi32((int)LANE_PRIME);
+
+    int blocks = length / BLOCK_SIZE;
+    for (int b = 0; b < blocks; b++) {
+        const char* block = key + b * BLOCK_SIZE;
+        low = laneStepSse2(low, _mm_loadu_si128((const __m128i*)block), prime);
+        high = laneStepSse2(high, _mm_loadu_si128((const __m128i*)(block + 16)),
+                            prime);
+    }
+
+    uint32_t lanes[LANE_COUNT];
+    _mm_storeu_si128((__m128i*)lanes, low);
+    _mm_storeu_si128((__m128i*)(lanes + 4), high);
+
+    int done = blocks * BLOCK_SIZE;
+    return finishBlocks(lanes, key + done, length - done, length);
+}
+
+__attribute__((target("avx2")))
+static uint32_t hashBlocksAvx2(const char* key, int length) {
+    __m256i lanes = _mm256_setr_epi32(
+        (int)LANE_SEED(0), (int)LANE_SEED(1), (int)LANE_SEED(2),
+        (int)LANE_SEED(3), (int)LANE_SEED(4), (int)LANE_SEED(5),
+        (int)LANE_SEED(6), (int)LANE_SEED(7));
+    const __m256i prime = _mm256_set1_epi32((int)LANE_PRIME);
+
+    int blocks = length / BLOCK_SIZE;
+    for (int b = 0; b < blocks; b++) {
+        __m256i words = _mm256_loadu_si256(
+            (const __m256i*)(key + b * BLOCK_SIZE));
+        __m256i x = _mm256_xor_si256(lanes, words);
+        x = _mm256_or_si256(_mm256_slli_epi32(x, 15), _mm256_srli_epi32(x, 17));
+        lanes = _mm256_mullo_epi32(x, prime);
+    }
+
+    uint32_t result[LANE_COUNT];
+    _mm256_storeu_si256((__m256i*)result, lanes);
+
+    int done = blocks * BLOCK_SIZE;
+    return finishBlocks(result, key + done, length - done, length);
+}
+
+#endif
+
+int hashBlockImplementations(HashImplementation* out, int capacity) {
+    int count = 0;
+    if (count < capacity) {
+        out[count++] = (HashImplementation){"scalar", hashBlocksScalar};
+    }
+
+#ifdef FLS_HASH_X86
+    // CPUID tells us what this machine supports; the compiler only had to
+    // be able to emit the instructions.
+    __builtin_cpu_init();
+    if (count < capacity && __builtin_cpu_supports("sse2")) {
+        out[count++] = (HashImplementation){"sse2", hashBlocksSse2};
+    }
+    if (count < capacity && __builtin_cpu_supports("avx2")) {
+        out[count++] = (HashImplementation){"avx2", hashBlocksAvx2};
+    }
+#endif
+
+    return count;
+}
+
+static uint32_t resolveBlockHash(const char* key, int length);
+
+// Starts out as the resolver, which replaces itself with the best
+// implementation on the first long string.
+static HashFn blockHash = resolveBlockHash;
+
+static uint32_t resolveBlockHash(const char* key, int length) {
+    HashImplementation implementations[3];
+    int count = hashBlockImplementations(implementations, 3);
+    blockHash = implementations[count - 1].function;
+    return blockHash(key, length);
+}
+
+uint32_t hashBytes(const char* key, int length) {
+    if (length < HASH_BLOCK_MIN_LENGTH) return hashFnv1a(key, length);
+    return blockHash(key, length);
+}
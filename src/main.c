@@ -2,15 +2,26 @@
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
+#include "bytecode.h"
 #include "chunk.h"
 #include "debug.h"
+#include "pool.h"
 #include "vm.h"
 
+// Set by --pool-stats: print allocator statistics once the script ends.
+static bool showPoolStats = false;
+
+#define USAGE                                                                  \
+    "Usage: fls [--preflight] [--pool-stats] [--max-stack depth] "            \
+    "[--no-cache] [path]\n"                                                   \
+    "       fls --compile path [-o output]\n"
+
 // A simple Read-Eval-Print-Loop (REPL) for interactive mode.
 static void repl() {
     char line[1024];
@@ -73,29 +84,91 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-// Runs a script from a file.
+// Runs a script from a file, either source or a compiled image.
 static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(path, source);
-    free(source);
+    InterpretResult result;
+    if (isImageFile(path)) {
+        result = interpretImage(path);
+    } else {
+        char* source = readFile(path);
+        result = interpret(path, source);
+        free(source);
+    }
+
+    if (showPoolStats) dumpPoolStats();
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+// Compiles a script to an image without running it. The image goes next to
+// the script, as foo.flsc for foo.fls, unless an output path is given.
+static void compileFile(const char* path, const char* outputPath) {
+    char* defaultPath = NULL;
+    if (outputPath == NULL) {
+        size_t length = strlen(path);
+        bool flsExtension = length > 4 && strcmp(path + length - 4, ".fls") == 0;
+        defaultPath = (char*)malloc(length + 6);
+        if (defaultPath == NULL) {
+            fprintf(stderr, "Not enough memory.\n");
+            exit(74);
+        }
+        sprintf(defaultPath, "%s%s", path, flsExtension ? "c" : ".flsc");
+        outputPath = defaultPath;
+    }
+
+    char* source = readFile(path);
+    bool compiled = compileImage(path, source, outputPath);
+    free(source);
+    free(defaultPath);
+    if (!compiled) exit(65);
+}
+
 int main(int argc, const char* argv[]) {
     initVM();
 
-    if (argc == 1) {
+    const char* path = NULL;
+    const char* outputPath = NULL;
+    bool compileOnly = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--compile") == 0) {
+            compileOnly = true;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            vm.moduleCache = false;
+        } else if (strcmp(argv[i], "--preflight") == 0) {
+            vm.enable_preflight = true;
+        } else if (strcmp(argv[i], "--pool-stats") == 0) {
+            showPoolStats = true;
+        } else if (strcmp(argv[i], "--max-stack") == 0 && i + 1 < argc) {
+            // The deepest call nesting allowed before "Stack overflow.".
+            char* end;
+            long frames = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || frames < 1 || frames > INT_MAX / UINT8_COUNT) {
+                fprintf(stderr, "Invalid --max-stack depth \"%s\".\n", argv[i]);
+                exit(64);
+            }
+            vm.maxFrames = (int)frames;
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            fprintf(stderr, USAGE);
+            exit(64);
+        }
+    }
+
+    if (compileOnly || outputPath != NULL) {
+        if (!compileOnly || path == NULL) {
+            fprintf(stderr, USAGE);
+            exit(64);
+        }
+        compileFile(path, outputPath);
+    } else if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
-    } else if (argc == 3 && strcmp(argv[1], "--preflight") == 0) {
-        vm.enable_preflight = true;
-        runFile(argv[2]);
+        if (showPoolStats) dumpPoolStats();
     } else {
-        fprintf(stderr, "Usage: fls [--preflight] [path]\n");
-        exit(64);
+        runFile(path);
     }
 
     freeVM();
@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Control bytes. Full slots hold the top seven bits of the key's hash, so
+// their high bit is always clear.
+#define CONTROL_EMPTY   0x80
+#define CONTROL_DELETED 0xFE
+
+// Rehash once seven eighths of the slots are used, counting deleted ones.
+#define MAX_LOAD_NUMERATOR 7
+#define MAX_LOAD_DENOMINATOR 8
+
+// Beyond this many logged writes a minor collection might as well trace the
+// whole map.
+#define MAX_LOGGED_WRITES(capacity) ((capacity) / 8)
+
+static inline uint8_t hashTag(uint32_t hash) {
+    return (uint8_t)(hash >> 25);
+}
+
+static inline bool isFull(uint8_t control) {
+    return (control & 0x80) == 0;
+}
+
+static inline int maxLoad(int capacity) {
+    return capacity / MAX_LOAD_DENOMINATOR * MAX_LOAD_NUMERATOR;
+}
+
+// Spreads every bit of a 64-bit word into a 32-bit hash.
+static inline uint32_t mixBits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static uint32_t hashKey(Value key) {
+    if (IS_STRING(key)) return AS_STRING(key)->hash;
+    if (IS_NUMBER(key)) {
+        double number = AS_NUMBER(key);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return mixBits(bits);
+    }
+    if (IS_OBJ(key)) return mixBits((uint64_t)(uintptr_t)AS_OBJ(key));
+    if (IS_NIL(key)) return mixBits(1);
+    return mixBits(AS_BOOL(key) ? 3 : 2);
+}
+
+// Keys are canonical, so equal keys are the same bits and objects compare
+// by identity.
+static inline bool keysEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    if (a.type != b.type) return false;
+    switch (a.type) {
+        case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NIL:    return true;
+        case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+        default:         return false;
+    }
+#endif
+}
+
+// Each group query returns a bitmask with bit i set when slot start + i
+// matches.
+#ifdef __SSE2__
+
+typedef __m128i Group;
+
+static inline Group loadGroup(const uint8_t* control) {
+    return _mm_loadu_si128((const __m128i*)control);
+}
+
+static inline uint32_t matchTag(Group group, uint8_t tag) {
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+}
+
+// Empty and deleted are the only control bytes with the high bit set.
+static inline uint32_t matchEmptyOrDeleted(Group group) {
+    return (uint32_t)_mm_movemask_epi8(group);
+}
+
+#else
+
+typedef struct {
+    uint8_t bytes[MAP_GROUP_SIZE];
+} Group;
+
+static inline Group loadGroup(const uint8_t* control) {
+    Group group;
+    memcpy(group.bytes, control, MAP_GROUP_SIZE);
+    return group;
+}
+
+static inline uint32_t matchTag(Group group, uint8_t tag) {
+    uint32_t bits = 0;
+    for (int i = 0; i < MAP_GROUP_SIZE; i++) {
+        if (group.bytes[i] == tag) bits |= 1u << i;
+    }
+    return bits;
+}
+
+static inline uint32_t matchEmptyOrDeleted(Group group) {
+    uint32_t bits = 0;
+    for (int i = 0; i < MAP_GROUP_SIZE; i++) {
+        if (!isFull(group.bytes[i])) bits |= 1u << i;
+    }
+    return bits;
+}
+
+#endif
+
+static inline uint32_t matchEmpty(Group group) {
+    return matchTag(group, CONTROL_EMPTY);
+}
+
+// Writes a control byte, keeping the mirrored first group in step.
+static inline void setControl(MapTable* table, int slot, uint8_t control) {
+    table->control[slot] = control;
+    if (slot < MAP_GROUP_SIZE) {
+        table->control[table->capacity + slot] = control;
+    }
+}
+
+void initMapTable(MapTable* table) {
+    table->count = 0;
+    table->capacity = 0;
+    table->growthLeft = 0;
+    table->control = NULL;
+    table->keys = NULL;
+    table->values = NULL;
+    table->logWrites = false;
+    table->allDirty = false;
+    table->dirtyCount = 0;
+    table->dirtyCapacity = 0;
+    table->dirtySlots = NULL;
+}
+
+void freeMapTable(MapTable* table) {
+    if (table->capacity > 0) {
+        FREE_ARRAY(uint8_t, table->control, table->capacity + MAP_GROUP_SIZE);
+        FREE_ARRAY(Value, table->keys, table->capacity);
+        FREE_ARRAY(Value, table->values, table->capacity);
+    }
+    free(table->dirtySlots);
+    initMapTable(table);
+}
+
+// Probes group by group with growing strides. On a power-of-two capacity
+// this visits every group before repeating.
+static int findSlot(MapTable* table, Value key, uint32_t hash) {
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t position = hash & mask;
+    uint8_t tag = hashTag(hash);
+
+    for (uint32_t stride = MAP_GROUP_SIZE;; stride += MAP_GROUP_SIZE) {
+        Group group = loadGroup(&table->control[position]);
+        for (uint32_t bits = matchTag(group, tag); bits != 0; bits &= bits - 1) {
+            uint32_t slot = (position + (uint32_t)__builtin_ctz(bits)) & mask;
+            if (keysEqual(table->keys[slot], key)) return (int)slot;
+        }
+        // An empty slot ends the probe sequence: the key was never pushed
+        // past this group.
+        if (matchEmpty(group) != 0) return -1;
+        position = (position + stride) & mask;
+    }
+}
+
+static int findInsertSlot(MapTable* table, uint32_t hash) {
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t position = hash & mask;
+
+    for (uint32_t stride = MAP_GROUP_SIZE;; stride += MAP_GROUP_SIZE) {
+        uint32_t bits = matchEmptyOrDeleted(loadGroup(&table->control[position]));
+        if (bits != 0) {
+            return (int)((position + (uint32_t)__builtin_ctz(bits)) & mask);
+        }
+        position = (position + stride) & mask;
+    }
+}
+
+static void logWrite(MapTable* table, int slot) {
+    if (!table->logWrites || table->allDirty) return;
+
+    if (table->dirtyCount >= MAX_LOGGED_WRITES(table->capacity)) {
+        table->allDirty = true;
+        return;
+    }
+
+    if (table->dirtyCapacity < table->dirtyCount + 1) {
+        table->dirtyCapacity = GROW_CAPACITY(table->dirtyCapacity);
+        // Like the collector's own stacks, the log lives outside the managed
+        // heap so that growing it never triggers a collection.
+        int* slots = (int*)realloc(table->dirtySlots,
+                                   sizeof(int) * table->dirtyCapacity);
+        if (slots == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        table->dirtySlots = slots;
+    }
+    table->dirtySlots[table->dirtyCount++] = slot;
+}
+
+static void resize(MapTable* table, int capacity) {
+    uint8_t* control = ALLOCATE(uint8_t, capacity + MAP_GROUP_SIZE);
+    Value* keys = ALLOCATE(Value, capacity);
+    Value* values = ALLOCATE(Value, capacity);
+    memset(control, CONTROL_EMPTY, capacity + MAP_GROUP_SIZE);
+
+    MapTable resized = *table;
+    resized.capacity = capacity;
+    resized.control = control;
+    resized.keys = keys;
+    resized.values = values;
+
+    for (int i = 0; i < table->capacity; i++) {
+        if (!isFull(table->control[i])) continue;
+        int slot = findInsertSlot(&resized, hashKey(table->keys[i]));
+        setControl(&resized, slot, table->control[i]);
+        keys[slot] = table->keys[i];
+        values[slot] = table->values[i];
+    }
+
+    if (table->capacity > 0) {
+        FREE_ARRAY(uint8_t, table->control, table->capacity + MAP_GROUP_SIZE);
+        FREE_ARRAY(Value, table->keys, table->capacity);
+        FREE_ARRAY(Value, table->values, table->capacity);
+    }
+
+    table->capacity = capacity;
+    table->control = control;
+    table->keys = keys;
+    table->values = values;
+    table->growthLeft = maxLoad(capacity) - table->count;
+    // Every slot index changed.
+    if (table->logWrites) table->allDirty = true;
+}
+
+bool mapKey(Value* key, bool create) {
+    if (IS_STRING(*key)) {
+        ObjString* string = AS_STRING(*key);
+        string = create ? internString(string) : findInterned(string);
+        if (string == NULL) return false;
+        *key = OBJ_VAL(string);
+    } else if (IS_NUMBER(*key)) {
+        double number = AS_NUMBER(*key);
+        // NaN is the only number not equal to itself.
+        if (number != number) return false;
+        if (number == 0) *key = NUMBER_VAL(0);
+    }
+    return true;
+}
+
+bool mapTableGet(MapTable* table, Value key, Value* value) {
+    if (table->count == 0) return false;
+
+    int slot = findSlot(table, key, hashKey(key));
+    if (slot < 0) return false;
+
+    *value = table->values[slot];
+    return true;
+}
+
+bool mapTableSet(MapTable* table, Value key, Value value) {
+    uint32_t hash = hashKey(key);
+    if (table->count > 0) {
+        int slot = findSlot(table, key, hash);
+        if (slot >= 0) {
+            table->values[slot] = value;
+            logWrite(table, slot);
+            return false;
+        }
+    }
+
+    if (table->growthLeft == 0) {
+        // Rehash in place when deleted slots are what used up the room.
+        int capacity = table->capacity;
+        if (capacity == 0) {
+            capacity = MAP_GROUP_SIZE;
+        } else if (table->count + 1 > maxLoad(capacity) / 2) {
+            if (capacity < MAP_MAX_CAPACITY) {
+                capacity *= 2;
+            } else if (table->count == maxLoad(capacity)) {
+                fprintf(stderr, "Map too large\n");
+                exit(1);
+            }
+        }
+        resize(table, capacity);
+    }
+
+    int slot = findInsertSlot(table, hash);
+    if (table->control[slot] == CONTROL_EMPTY) table->growthLeft--;
+    setControl(table, slot, hashTag(hash));
+    table->keys[slot] = key;
+    table->values[slot] = value;
+    table->count++;
+    logWrite(table, slot);
+    return true;
+}
+
+bool mapTableDelete(MapTable* table, Value key) {
+    if (table->count == 0) return false;
+
+    int slot = findSlot(table, key, hashKey(key));
+    if (slot < 0) return false;
+
+    // If some group containing the slot has always had an empty slot, no
+    // probe ever passed through it, and it can go straight back to empty.
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t before = ((uint32_t)slot - MAP_GROUP_SIZE) & mask;
+    uint32_t emptyBefore = matchEmpty(loadGroup(&table->control[before]));
+    uint32_t emptyAfter = matchEmpty(loadGroup(&table->control[slot]));
+    int emptyRun = (emptyAfter != 0 ? __builtin_ctz(emptyAfter) : MAP_GROUP_SIZE) +
+                   (emptyBefore != 0 ? __builtin_clz(emptyBefore) - 16 : MAP_GROUP_SIZE);
+
+    if (emptyRun < MAP_GROUP_SIZE) {
+        setControl(table, slot, CONTROL_EMPTY);
+        table->growthLeft++;
+    } else {
+        setControl(table, slot, CONTROL_DELETED);
+    }
+    table->keys[slot] = NIL_VAL;
+    table->values[slot] = NIL_VAL;
+    table->count--;
+    return true;
+}
+
+void mapTableAddAll(MapTable* from, MapTable* to) {
+    for (int slot = mapTableNext(from, -1); slot >= 0;
+         slot = mapTableNext(from, slot)) {
+        mapTableSet(to, from->keys[slot], from->values[slot]);
+    }
+}
+
+int mapTableNext(MapTable* table, int slot) {
+    // Skips a group of empty slots at a time. A match past the end is in
+    // the mirrored bytes and means the real slots were all empty.
+    for (int start = slot + 1; start < table->capacity; start += MAP_GROUP_SIZE) {
+        uint32_t full = ~matchEmptyOrDeleted(loadGroup(&table->control[start])) & 0xFFFF;
+        if (full != 0) {
+            int found = start + __builtin_ctz(full);
+            return found < table->capacity ? found : -1;
+        }
+    }
+    return -1;
+}
+
+bool mapTableReserve(MapTable* table, int count) {
+    if (count <= table->count + table->growthLeft) return true;
+    if (count > maxLoad(MAP_MAX_CAPACITY)) return false;
+
+    int capacity = table->capacity == 0 ? MAP_GROUP_SIZE : table->capacity;
+    while (maxLoad(capacity) < count) capacity *= 2;
+    resize(table, capacity);
+    return true;
+}
+
+void markMapTable(MapTable* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        if (!isFull(table->control[i])) continue;
+        markValue(table->keys[i]);
+        markValue(table->values[i]);
+    }
+}
+
+void markMapTableWrites(MapTable* table) {
+    if (!table->logWrites || table->allDirty) {
+        markMapTable(table);
+        return;
+    }
+
+    for (int i = 0; i < table->dirtyCount; i++) {
+        int slot = table->dirtySlots[i];
+        // The key may have been deleted since.
+        if (!isFull(table->control[slot])) continue;
+        markValue(table->keys[slot]);
+        markValue(table->values[slot]);
+    }
+}
+
+void clearMapTableWrites(MapTable* table) {
+    table->allDirty = false;
+    table->dirtyCount = 0;
+}
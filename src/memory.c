@@ -2,15 +2,40 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include "compiler.h"
 #include "memory.h"
 #include "object.h"
+#include "pool.h"
 #include "vm.h"
 
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+// After a collection the next one is scheduled once the heap has grown by
+// this factor over what survived, but never below the initial threshold.
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_MIN_HEAP (1024 * 1024)
+// A minor collection runs once this many bytes have been allocated since the
+// last collection of either kind.
+#define NURSERY_SIZE (256 * 1024)
+// With DEBUG_STRESS_GC, every allocation collects; every this many of those
+// collections is a full one, so both collectors get exercised.
+#define STRESS_FULL_INTERVAL 8
+
+// Set while a minor collection runs. Marking then stops at old objects,
+// which are assumed live until the next full collection.
+static bool minorCollection = false;
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   vm.bytesAllocated += newSize - oldSize;
   
   if (newSize == 0) {
-    free(pointer);
+    if (poolHandles(oldSize)) {
+      poolFree(pointer, oldSize);
+    } else {
+      free(pointer);
+    }
     return NULL;
   }
 
@@ -33,6 +58,29 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return pointer ? pointer : (void*)1;
   }
 
+  if (newSize > oldSize) {
+    vm.nurseryBytes += newSize - oldSize;
+#ifdef DEBUG_STRESS_GC
+    static unsigned int stressCollections = 0;
+    if (++stressCollections % STRESS_FULL_INTERVAL == 0) {
+      collectGarbage();
+    } else {
+      collectNursery();
+    }
+#endif
+    if (vm.bytesAllocated > vm.nextGC) {
+      collectGarbage();
+    } else if (vm.nurseryBytes > NURSERY_SIZE) {
+      collectNursery();
+    }
+  }
+
+  // Small blocks, and anything growing out of or shrinking into that
+  // range, are handled by the size-class pool.
+  if (poolHandles(oldSize) || poolHandles(newSize)) {
+    return poolReallocate(pointer, oldSize, newSize);
+  }
+
   if (vm.profiler.preflight_complete && pointer == NULL) {
     uint64_t token_id = vm.bytesAllocated;
     MemoryPlan* plan = findMemoryPlan(&vm.profiler, token_id);
@@ -54,6 +102,10 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 }
 
 static void freeObject(Obj* object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
   switch (object->type) {
     case OBJ_MODULE: {
       ObjModule* module = (ObjModule*)object;
@@ -83,7 +135,7 @@ static void freeObject(Obj* object) {
     }
     case OBJ_MAP: {
       ObjMap* map = (ObjMap*)object;
-      freeTable(&map->table);
+      freeMapTable(&map->table);
       FREE(ObjMap, object);
       break;
     }
@@ -92,21 +144,307 @@ static void freeObject(Obj* object) {
       break;
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+      reallocate(object, STRING_SIZE(string->length), 0);
       break;
     }
     case OBJ_UPVALUE:
       FREE(ObjUpvalue, object);
       break;
+    case OBJ_ROPE:
+      FREE(ObjRope, object);
+      break;
+    case OBJ_STRING_BUILDER: {
+      ObjStringBuilder* builder = (ObjStringBuilder*)object;
+      FREE_ARRAY(char, builder->chars, builder->capacity);
+      FREE(ObjStringBuilder, object);
+      break;
+    }
   }
 }
 
-void freeObjects() {
+void markObject(Obj* object) {
+  if (object == NULL) return;
+  if (object->isMarked) return;
+  if (minorCollection && !object->isYoung) return;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void*)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  object->isMarked = true;
+
+  if (vm.grayCapacity < vm.grayCount + 1) {
+    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+    // The gray stack is allocated with the system allocator so that growing
+    // it can never recursively trigger a collection.
+    Obj** grayStack = (Obj**)realloc(vm.grayStack,
+                                     sizeof(Obj*) * vm.grayCapacity);
+    if (grayStack == NULL) {
+      fprintf(stderr, "Memory allocation failed\n");
+      exit(1);
+    }
+    vm.grayStack = grayStack;
+  }
+
+  vm.grayStack[vm.grayCount++] = object;
+}
+
+void markValue(Value value) {
+  if (IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+static void markArray(ValueArray* array) {
+  for (int i = 0; i < array->count; i++) {
+    markValue(array->values[i]);
+  }
+}
+
+// Marks everything a gray object references, turning it black.
+static void blackenObject(Obj* object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p blacken ", (void*)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  switch (object->type) {
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      markObject((Obj*)closure->function);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        markObject((Obj*)closure->upvalues[i]);
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      markObject((Obj*)function->name);
+      markObject((Obj*)function->module);
+      markArray(&function->chunk.constants);
+      break;
+    }
+    case OBJ_LIST: {
+      ObjList* list = (ObjList*)object;
+      markArray(list->items);
+      break;
+    }
+    case OBJ_MAP: {
+      ObjMap* map = (ObjMap*)object;
+      // An old map only reaches this in a minor collection through the
+      // remembered set, and only the slots written since can be young.
+      if (minorCollection && !object->isYoung) {
+        markMapTableWrites(&map->table);
+      } else {
+        markMapTable(&map->table);
+      }
+      break;
+    }
+    case OBJ_MODULE: {
+      ObjModule* module = (ObjModule*)object;
+      markObject((Obj*)module->name);
+      markTable(&module->variables);
+      break;
+    }
+    case OBJ_UPVALUE:
+      markValue(((ObjUpvalue*)object)->closed);
+      break;
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*)object;
+      markObject(rope->left);
+      markObject(rope->right);
+      markObject((Obj*)rope->flat);
+      break;
+    }
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+    case OBJ_STRING_BUILDER:
+      break;
+  }
+}
+
+void rememberObject(Obj* object) {
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    // Like the gray stack, this lives outside the managed heap.
+    Obj** remembered = (Obj**)realloc(vm.remembered,
+                                      sizeof(Obj*) * vm.rememberedCapacity);
+    if (remembered == NULL) {
+      fprintf(stderr, "Memory allocation failed\n");
+      exit(1);
+    }
+    vm.remembered = remembered;
+  }
+
+  object->isRemembered = true;
+  vm.remembered[vm.rememberedCount++] = object;
+}
+
+// Old objects written since the last collection may be the only thing
+// keeping a young object alive, so a minor collection traces from them.
+static void markRemembered() {
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    blackenObject(vm.remembered[i]);
+  }
+}
+
+// Every collection promotes all young survivors, after which no old object
+// points into the nursery any more.
+static void clearRemembered() {
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    Obj* object = vm.remembered[i];
+    object->isRemembered = false;
+    if (object->type == OBJ_MAP) {
+      clearMapTableWrites(&((ObjMap*)object)->table);
+    }
+  }
+  vm.rememberedCount = 0;
+}
+
+static void markRoots() {
+  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    markValue(*slot);
+  }
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    markObject((Obj*)vm.frames[i].function);
+  }
+
+  // The names in globalNames are the keys of globalSlots.
+  markTable(&vm.globalSlots);
+  markArray(&vm.globalValues);
+  markTable(&vm.modules);
+  markCompilerRoots();
+}
+
+static void traceReferences() {
+  while (vm.grayCount > 0) {
+    Obj* object = vm.grayStack[--vm.grayCount];
+    blackenObject(object);
+  }
+}
+
+static void sweep() {
+  Obj* previous = NULL;
   Obj* object = vm.objects;
+  while (object != NULL) {
+    if (object->isMarked) {
+      object->isMarked = false;
+      previous = object;
+      object = object->next;
+    } else {
+      Obj* unreached = object;
+      object = object->next;
+      if (previous != NULL) {
+        previous->next = object;
+      } else {
+        vm.objects = object;
+      }
+
+      freeObject(unreached);
+    }
+  }
+}
+
+// Frees unreached young objects and promotes the survivors to the old list.
+// Dead young strings are dropped from the intern table one by one here, so a
+// minor collection never has to scan the whole table.
+static void sweepNursery() {
+  Obj* object = vm.youngObjects;
+  while (object != NULL) {
+    Obj* next = object->next;
+    if (object->isMarked) {
+      object->isMarked = false;
+      object->isYoung = false;
+      if (object->type == OBJ_MAP) {
+        ((ObjMap*)object)->table.logWrites = true;
+      }
+      object->next = vm.objects;
+      vm.objects = object;
+    } else {
+      if (object->type == OBJ_STRING && ((ObjString*)object)->isInterned) {
+        tableDelete(&vm.strings, (ObjString*)object);
+      }
+      freeObject(object);
+    }
+    object = next;
+  }
+  vm.youngObjects = NULL;
+}
+
+void collectGarbage() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+
+  markRoots();
+  traceReferences();
+  // Interned strings are weak references: drop the ones nothing else uses
+  // before sweep() frees them.
+  tableRemoveWhite(&vm.strings);
+  clearRemembered();
+  sweep();
+  sweepNursery();
+
+  vm.nurseryBytes = 0;
+  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  if (vm.nextGC < GC_MIN_HEAP) {
+    vm.nextGC = GC_MIN_HEAP;
+  }
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+#endif
+}
+
+void collectNursery() {
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+
+  minorCollection = true;
+  markRoots();
+  markRemembered();
+  traceReferences();
+  clearRemembered();
+  sweepNursery();
+  minorCollection = false;
+
+  vm.nurseryBytes = 0;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu)\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+}
+
+static void freeList(Obj* object) {
   while (object != NULL) {
     Obj* next = object->next;
     freeObject(object);
     object = next;
   }
 }
+
+void freeObjects() {
+  freeList(vm.objects);
+  freeList(vm.youngObjects);
+  vm.objects = NULL;
+  vm.youngObjects = NULL;
+
+  free(vm.remembered);
+  vm.remembered = NULL;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+
+  free(vm.grayStack);
+  vm.grayStack = NULL;
+  vm.grayCount = 0;
+  vm.grayCapacity = 0;
+}
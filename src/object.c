@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -14,8 +16,16 @@
 static Obj* allocateObject(size_t size, ObjType type) {
   Obj* object = (Obj*)reallocate(NULL, 0, size);
   object->type = type;
-  object->next = vm.objects;
-  vm.objects = object;
+  object->isMarked = false;
+  object->isYoung = true;
+  object->isRemembered = false;
+  object->next = vm.youngObjects;
+  vm.youngObjects = object;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p allocate %zu for %d\n", (void*)object, size, type);
+#endif
+
   return object;
 }
 
@@ -36,21 +46,28 @@ ObjFunction* newFunction() {
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxStackDepth = 0;
   function->name = NULL;
+  function->module = NULL;
+  function->image = NULL;
+  function->constantsOffset = 0;
   initChunk(&function->chunk);
   return function;
 }
 
 ObjList* newList() {
+  // Allocate the item array first: allocating it after the list could
+  // trigger a collection while the new list is not yet reachable.
+  ValueArray* items = ALLOCATE(ValueArray, 1);
+  initValueArray(items);
   ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
-  list->items = ALLOCATE(ValueArray, 1);
-  initValueArray(list->items);
+  list->items = items;
   return list;
 }
 
 ObjMap* newMap() {
     ObjMap* map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
-    initTable(&map->table);
+    initMapTable(&map->table);
     return map;
 }
 
@@ -67,43 +84,156 @@ ObjNative* newNative(NativeFn function) {
   return native;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-  ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// Returns an uninterned string with room for length characters for the
+// caller to fill in. Its hash is computed when first needed.
+ObjString* newString(int length) {
+  ObjString* string = (ObjString*)allocateObject(STRING_SIZE(length),
+                                                 OBJ_STRING);
   string->length = length;
-  string->chars = chars;
-  string->hash = hash;
-  tableSet(&vm.strings, string, NIL_VAL);
+  string->hash = 0;
+  string->hasHash = false;
+  string->isInterned = false;
+  string->chars[length] = '\0';
   return string;
 }
 
-static uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
-  }
-  return hash;
+ObjString* newStringCopy(const char* chars, int length) {
+  ObjString* string = newString(length);
+  memcpy(string->chars, chars, length);
+  return string;
 }
 
-ObjString* takeString(char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-  if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned;
+uint32_t stringHash(ObjString* string) {
+  if (!string->hasHash) {
+    string->hash = hashBytes(string->chars, string->length);
+    string->hasHash = true;
   }
-  return allocateString(chars, length, hash);
+  return string->hash;
+}
+
+bool stringsEqual(ObjString* a, ObjString* b) {
+  if (a == b) return true;
+  if (a->length != b->length) return false;
+  // Equal interned strings are always the same object.
+  if (a->isInterned && b->isInterned) return false;
+  if (a->hasHash && b->hasHash && a->hash != b->hash) return false;
+  return memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+static ObjString* addInterned(ObjString* string) {
+  string->isInterned = true;
+
+  push(OBJ_VAL(string));
+  tableSet(&vm.strings, string, NIL_VAL);
+  pop();
+
+  return string;
+}
+
+ObjString* findInterned(ObjString* string) {
+  if (string->isInterned) return string;
+  return tableFindString(&vm.strings, string->chars, string->length,
+                         stringHash(string));
+}
+
+ObjString* internString(ObjString* string) {
+  ObjString* interned = findInterned(string);
+  if (interned != NULL) return interned;
+  return addInterned(string);
 }
 
 ObjString* copyString(const char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
+  uint32_t hash = hashBytes(chars, length);
   ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
   if (interned != NULL) return interned;
 
-  char* heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  ObjString* string = newStringCopy(chars, length);
+  string->hash = hash;
+  string->hasHash = true;
+  return addInterned(string);
+}
+
+ObjRope* newRope(Obj* left, Obj* right, int length) {
+  ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+  return rope;
+}
+
+// Writes the characters of a rope into dest, back to front. Appending in a
+// loop builds chains as deep as the number of appends, so the tree is
+// walked with an explicit stack instead of recursion.
+static void copyRopeChars(ObjRope* rope, char* dest) {
+  char* end = dest + rope->length;
+  Obj** pending = NULL;
+  int pendingCount = 0;
+  int pendingCapacity = 0;
+
+  Obj* node = (Obj*)rope;
+  for (;;) {
+    if (node->type == OBJ_ROPE && ((ObjRope*)node)->flat == NULL) {
+      ObjRope* inner = (ObjRope*)node;
+      if (pendingCapacity < pendingCount + 1) {
+        pendingCapacity = pendingCapacity < 8 ? 8 : pendingCapacity * 2;
+        pending = (Obj**)realloc(pending, sizeof(Obj*) * pendingCapacity);
+        if (pending == NULL) {
+          fprintf(stderr, "Memory allocation failed\n");
+          exit(1);
+        }
+      }
+      pending[pendingCount++] = inner->left;
+      node = inner->right;
+      continue;
+    }
+
+    ObjString* leaf = node->type == OBJ_ROPE ? ((ObjRope*)node)->flat
+                                             : (ObjString*)node;
+    end -= leaf->length;
+    memcpy(end, leaf->chars, leaf->length);
+
+    if (pendingCount == 0) break;
+    node = pending[--pendingCount];
+  }
+
+  free(pending);
+}
+
+// The rope must be reachable from a root: building the string allocates.
+ObjString* flattenRope(ObjRope* rope) {
+  if (rope->flat != NULL) return rope->flat;
+
+  ObjString* string = newString(rope->length);
+  copyRopeChars(rope, string->chars);
+  rope->flat = string;
+  rope->left = NULL;
+  rope->right = NULL;
+  WRITE_BARRIER(rope);
+  return rope->flat;
+}
+
+ObjStringBuilder* newStringBuilder() {
+  ObjStringBuilder* builder = ALLOCATE_OBJ(ObjStringBuilder,
+                                           OBJ_STRING_BUILDER);
+  builder->chars = NULL;
+  builder->length = 0;
+  builder->capacity = 0;
+  return builder;
+}
+
+// The builder must be reachable from a root: growing the buffer allocates.
+void builderAppend(ObjStringBuilder* builder, const char* chars, int length) {
+  if (builder->capacity < builder->length + length) {
+    int oldCapacity = builder->capacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    while (capacity < builder->length + length) capacity *= 2;
+    builder->chars = GROW_ARRAY(char, builder->chars, oldCapacity, capacity);
+    builder->capacity = capacity;
+  }
+
+  memcpy(builder->chars + builder->length, chars, length);
+  builder->length += length;
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
@@ -151,5 +281,26 @@ void printObject(Value value) {
     case OBJ_UPVALUE:
       printf("upvalue");
       break;
+    case OBJ_ROPE: {
+      // Printing must not allocate on the managed heap, so an unflattened
+      // rope is copied into a scratch buffer.
+      ObjRope* rope = AS_ROPE(value);
+      if (rope->flat != NULL) {
+        printf("%s", rope->flat->chars);
+        break;
+      }
+      char* chars = (char*)malloc((size_t)rope->length);
+      if (chars == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+      }
+      copyRopeChars(rope, chars);
+      fwrite(chars, 1, (size_t)rope->length, stdout);
+      free(chars);
+      break;
+    }
+    case OBJ_STRING_BUILDER:
+      printf("<string builder>");
+      break;
   }
 }
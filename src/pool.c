@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+// Slab headers take one granule so the blocks after them stay aligned.
+#define SLAB_HEADER_SIZE POOL_GRANULARITY
+
+static PoolClass classes[POOL_CLASS_COUNT];
+
+static int classIndex(size_t size) {
+    return (int)((size + POOL_GRANULARITY - 1) / POOL_GRANULARITY) - 1;
+}
+
+static size_t classBlockSize(int index) {
+    return (size_t)(index + 1) * POOL_GRANULARITY;
+}
+
+static void addSlab(PoolClass* poolClass) {
+    PoolSlab* slab = (PoolSlab*)malloc(POOL_SLAB_SIZE);
+    if (slab == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    slab->next = poolClass->slabs;
+    poolClass->slabs = slab;
+    poolClass->slabCount++;
+    poolClass->bumpStart = (char*)slab + SLAB_HEADER_SIZE;
+    poolClass->bumpEnd = (char*)slab + POOL_SLAB_SIZE;
+}
+
+void* poolAllocate(size_t size) {
+    int index = classIndex(size);
+    PoolClass* poolClass = &classes[index];
+    size_t blockSize = classBlockSize(index);
+
+    void* block;
+    if (poolClass->freeList != NULL) {
+        block = poolClass->freeList;
+        poolClass->freeList = poolClass->freeList->next;
+    } else {
+        if ((size_t)(poolClass->bumpEnd - poolClass->bumpStart) < blockSize) {
+            addSlab(poolClass);
+        }
+        block = poolClass->bumpStart;
+        poolClass->bumpStart += blockSize;
+    }
+
+    poolClass->liveBlocks++;
+    poolClass->liveBytes += size;
+    poolClass->totalAllocations++;
+    return block;
+}
+
+void poolFree(void* pointer, size_t size) {
+    if (pointer == NULL) return;
+
+    PoolClass* poolClass = &classes[classIndex(size)];
+    PoolBlock* block = (PoolBlock*)pointer;
+    block->next = poolClass->freeList;
+    poolClass->freeList = block;
+
+    poolClass->liveBlocks--;
+    poolClass->liveBytes -= size;
+}
+
+void* poolReallocate(void* pointer, size_t oldSize, size_t newSize) {
+    if (pointer != NULL && poolHandles(oldSize) && poolHandles(newSize) &&
+        classIndex(oldSize) == classIndex(newSize)) {
+        classes[classIndex(oldSize)].liveBytes += newSize - oldSize;
+        return pointer;
+    }
+
+    void* result = poolHandles(newSize) ? poolAllocate(newSize) : malloc(newSize);
+    if (result == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    if (pointer != NULL) {
+        memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+        if (poolHandles(oldSize)) {
+            poolFree(pointer, oldSize);
+        } else {
+            free(pointer);
+        }
+    }
+    return result;
+}
+
+void freePools() {
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        PoolClass* poolClass = &classes[i];
+        PoolSlab* slab = poolClass->slabs;
+        while (slab != NULL) {
+            PoolSlab* next = slab->next;
+            free(slab);
+            slab = next;
+        }
+
+        PoolClass empty = {0};
+        *poolClass = empty;
+    }
+}
+
+void dumpPoolStats() {
+    size_t totalSlabBytes = 0;
+    size_t totalUsedBytes = 0;
+    size_t totalLiveBytes = 0;
+
+    fprintf(stderr, "\n=== Pool Allocator ===\n");
+    fprintf(stderr, "%6s %6s %10s %12s %12s %8s %8s\n",
+            "class", "slabs", "live", "live bytes", "allocations",
+            "waste", "free");
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        PoolClass* poolClass = &classes[i];
+        if (poolClass->slabCount == 0) continue;
+
+        size_t slabBytes = (size_t)poolClass->slabCount *
+                           (POOL_SLAB_SIZE - SLAB_HEADER_SIZE);
+        size_t usedBytes = poolClass->liveBlocks * classBlockSize(i);
+
+        // Waste is rounding inside live blocks; free is slab space not
+        // holding a live block, whether on the free list or never carved.
+        double waste = usedBytes == 0 ? 0.0 :
+            100.0 * (double)(usedBytes - poolClass->liveBytes) / (double)usedBytes;
+        double unused = 100.0 * (double)(slabBytes - usedBytes) / (double)slabBytes;
+
+        fprintf(stderr, "%6zu %6d %10zu %12zu %12zu %7.1f%% %7.1f%%\n",
+                classBlockSize(i), poolClass->slabCount,
+                poolClass->liveBlocks, poolClass->liveBytes,
+                poolClass->totalAllocations, waste, unused);
+
+        totalSlabBytes += slabBytes;
+        totalUsedBytes += usedBytes;
+        totalLiveBytes += poolClass->liveBytes;
+    }
+
+    fprintf(stderr, "Slab memory: %zu bytes, %zu in live blocks, %zu requested\n",
+            totalSlabBytes, totalUsedBytes, totalLiveBytes);
+    fprintf(stderr, "======================\n\n");
+}
@@ -6,6 +6,11 @@
 #include "table.h"
 #include "value.h"
 
+// Capacity is always zero or a power of two, so hashes are reduced to a slot
+// with a mask. Collisions are resolved with Robin Hood linear probing: an
+// insert takes over any slot whose entry is closer to its home slot than the
+// new key would be, which keeps probe sequences short and even. Deletes shift
+// the following entries back instead of leaving tombstones.
 #define TABLE_MAX_LOAD 0.75
 
 void initTable(Table* table) {
@@ -19,36 +24,80 @@ void freeTable(Table* table) {
     initTable(table);
 }
 
-// The core function for finding an entry in the hash table.
-// It uses linear probing to resolve collisions.
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash % capacity;
-    Entry* tombstone = NULL;
+// How far an occupied entry sits from the slot its hash maps to.
+static inline uint32_t probeDistance(Entry* entry, uint32_t index, uint32_t mask) {
+    return (index - (entry->key->hash & mask)) & mask;
+}
+
+// Returns the entry holding key, or NULL. The search stops at an empty slot
+// or at an entry nearer its home than key would be at that point, since an
+// insert of key would have claimed that slot.
+static Entry* findEntry(Table* table, ObjString* key) {
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t index = key->hash & mask;
+
+    for (uint32_t distance = 0;; distance++) {
+        Entry* entry = &table->entries[index];
+        if (entry->key == key) return entry;
+        if (entry->key == NULL || probeDistance(entry, index, mask) < distance) {
+            return NULL;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+// Places a key that is not in the table yet, displacing richer entries.
+static void insertEntry(Entry* entries, int capacity, ObjString* key, Value value) {
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t index = key->hash & mask;
+    uint32_t distance = 0;
 
     for (;;) {
         Entry* entry = &entries[index];
         if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone.
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // We found the key.
-            return entry;
+            entry->key = key;
+            entry->value = value;
+            return;
+        }
+
+        uint32_t existing = probeDistance(entry, index, mask);
+        if (existing < distance) {
+            Entry displaced = *entry;
+            entry->key = key;
+            entry->value = value;
+            key = displaced.key;
+            value = displaced.value;
+            distance = existing;
         }
 
-        index = (index + 1) % capacity;
+        index = (index + 1) & mask;
+        distance++;
     }
 }
 
+// Removes the entry at index by shifting back every following entry that is
+// not already in its home slot.
+static void removeEntry(Table* table, uint32_t index) {
+    uint32_t mask = (uint32_t)table->capacity - 1;
+
+    for (;;) {
+        uint32_t next = (index + 1) & mask;
+        Entry* entry = &table->entries[next];
+        if (entry->key == NULL || probeDistance(entry, next, mask) == 0) break;
+        table->entries[index] = *entry;
+        index = next;
+    }
+
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
+    table->count--;
+}
+
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    Entry* entry = findEntry(table, key);
+    if (entry == NULL) return false;
 
     *value = entry->value;
     return true;
@@ -61,15 +110,10 @@ static void adjustCapacity(Table* table, int capacity) {
         entries[i].value = NIL_VAL;
     }
 
-    table->count = 0;
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
         if (entry->key == NULL) continue;
-
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        insertEntry(entries, capacity, entry->key, entry->value);
     }
 
     FREE_ARRAY(Entry, table->entries, table->capacity);
@@ -78,29 +122,32 @@ static void adjustCapacity(Table* table, int capacity) {
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
+    if (table->count > 0) {
+        Entry* entry = findEntry(table, key);
+        if (entry != NULL) {
+            entry->value = value;
+            return false;
+        }
+    }
+
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+        // GROW_CAPACITY doubles from 8, keeping the capacity a power of two.
         int capacity = GROW_CAPACITY(table->capacity);
         adjustCapacity(table, capacity);
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
-
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    insertEntry(table->entries, table->capacity, key, value);
+    table->count++;
+    return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    Entry* entry = findEntry(table, key);
+    if (entry == NULL) return false;
 
-    // Place a tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    removeEntry(table, (uint32_t)(entry - table->entries));
     return true;
 }
 
@@ -116,19 +163,39 @@ void tableAddAll(Table* from, Table* to) {
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash % table->capacity;
-    for (;;) {
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t index = hash & mask;
+    for (uint32_t distance = 0;; distance++) {
         Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length &&
-                   entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
+        if (entry->key == NULL) return NULL;
+
+        if (entry->key->hash == hash &&
+            entry->key->length == length &&
+            memcmp(entry->key->chars, chars, length) == 0) {
             // We found it.
             return entry->key;
         }
+        if (probeDistance(entry, index, mask) < distance) return NULL;
+
+        index = (index + 1) & mask;
+    }
+}
 
-        index = (index + 1) % table->capacity;
+void markTable(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        markObject((Obj*)entry->key);
+        markValue(entry->value);
+    }
+}
+
+void tableRemoveWhite(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        // Removing shifts the next entry back into this slot, so it is
+        // checked again.
+        while (table->entries[i].key != NULL &&
+               !table->entries[i].key->obj.isMarked) {
+            removeEntry(table, (uint32_t)i);
+        }
     }
 }
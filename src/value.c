@@ -59,36 +59,43 @@ Value removeValueArray(ValueArray* array, int index) {
 
 // Prints a value.
 void printValue(Value value) {
-    switch (value.type) {
-        case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
-            break;
-        case VAL_NIL: 
-            printf("nil"); 
-            break;
-        case VAL_NUMBER: {
-            double num = AS_NUMBER(value);
-            if (num == (long long)num && num >= LLONG_MIN && num <= LLONG_MAX) {
-                printf("%lld", (long long)num);
-            } else {
-                printf("%.15g", num);
-            }
-            break;
+    if (IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        printf("nil");
+    } else if (IS_NUMBER(value)) {
+        double num = AS_NUMBER(value);
+        if (num == (long long)num && num >= LLONG_MIN && num <= LLONG_MAX) {
+            printf("%lld", (long long)num);
+        } else {
+            printf("%.15g", num);
         }
-        case VAL_OBJ: 
-            printObject(value); 
-            break;
+    } else if (IS_OBJ(value)) {
+        printObject(value);
     }
 }
 
 // Checks if two values are equal.
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    // Compare numbers as doubles so that NaN != NaN and 0 == -0.
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    if (a == b) return true;
+    return IS_STRING(a) && IS_STRING(b) &&
+           stringsEqual(AS_STRING(a), AS_STRING(b));
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:    return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            if (AS_OBJ(a) == AS_OBJ(b)) return true;
+            return IS_STRING(a) && IS_STRING(b) &&
+                   stringsEqual(AS_STRING(a), AS_STRING(b));
         default:         return false; // Unreachable.
     }
+#endif
 }
@@ -22,12 +22,14 @@ double fmod(double x, double y);
 #include "../std/include/io.h"
 #include "../std/include/math.h"
 #include "../std/include/random.h"
+#include "bytecode.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
 #include "error.h"
 #include "memory.h"
 #include "object.h"
+#include "pool.h"
 #include "profiler.h"
 #include "vm.h"
 
@@ -103,7 +105,7 @@ static Value toStringNative(int argCount, Value *args) {
       runtimeError("toString() number conversion failed.");
       return NIL_VAL;
     }
-    return OBJ_VAL(copyString(buffer, length));
+    return OBJ_VAL(newStringCopy(buffer, length));
   } else if (IS_STRING(args[0])) {
     return args[0];
   } else {
@@ -222,6 +224,7 @@ static Value listSetNative(int argCount, Value *args) {
   }
 
   list->items->values[index] = args[2];
+  WRITE_BARRIER(list);
   return args[2];
 }
 
@@ -238,6 +241,7 @@ static Value listPushNative(int argCount, Value *args) {
 
   ObjList *list = AS_LIST(args[0]);
   writeValueArray(list->items, args[1]);
+  WRITE_BARRIER(list);
   return args[1];
 }
 
@@ -298,6 +302,295 @@ static Value listShiftNative(int argCount, Value *args) {
   return removeValueArray(list->items, 0);
 }
 
+// --- List sorting ---
+
+static bool callFromNative(int argCount);
+
+// Lists shorter than this are sorted by insertion alone.
+#define SORT_INSERTION_LIMIT 16
+
+static void insertionSortNumbers(double *items, int count) {
+  for (int i = 1; i < count; i++) {
+    double item = items[i];
+    int j = i;
+    while (j > 0 && items[j - 1] > item) {
+      items[j] = items[j - 1];
+      j--;
+    }
+    items[j] = item;
+  }
+}
+
+static void siftDownNumbers(double *items, int root, int count) {
+  double item = items[root];
+  for (;;) {
+    int child = 2 * root + 1;
+    if (child >= count)
+      break;
+    if (child + 1 < count && items[child + 1] > items[child])
+      child++;
+    if (items[child] <= item)
+      break;
+    items[root] = items[child];
+    root = child;
+  }
+  items[root] = item;
+}
+
+static void heapSortNumbers(double *items, int count) {
+  for (int i = count / 2 - 1; i >= 0; i--) {
+    siftDownNumbers(items, i, count);
+  }
+  for (int end = count - 1; end > 0; end--) {
+    double top = items[0];
+    items[0] = items[end];
+    items[end] = top;
+    siftDownNumbers(items, 0, end);
+  }
+}
+
+// Introsort: quicksort with a median-of-three pivot that gives up and
+// heapsorts a range once it has partitioned it too many times. Ranges left
+// shorter than SORT_INSERTION_LIMIT are finished by one insertion pass. The
+// items must not contain NaN.
+static void introSortNumbers(double *items, int count, int depthLimit) {
+  while (count > SORT_INSERTION_LIMIT) {
+    if (depthLimit-- == 0) {
+      heapSortNumbers(items, count);
+      return;
+    }
+
+    // Ordering the first, middle and last items leaves sentinels at both
+    // ends, so the scans below need no bounds checks.
+    double *a = &items[0], *b = &items[count / 2], *c = &items[count - 1];
+    double t;
+    if (*b < *a) {
+      t = *a;
+      *a = *b;
+      *b = t;
+    }
+    if (*c < *b) {
+      t = *b;
+      *b = *c;
+      *c = t;
+    }
+    if (*b < *a) {
+      t = *a;
+      *a = *b;
+      *b = t;
+    }
+    double pivot = *b;
+
+    int i = 0;
+    int j = count - 1;
+    for (;;) {
+      while (items[++i] < pivot) {}
+      while (pivot < items[--j]) {}
+      if (i >= j)
+        break;
+      t = items[i];
+      items[i] = items[j];
+      items[j] = t;
+    }
+
+    // Recurse into the smaller side and loop on the larger one.
+    if (i < count - i) {
+      introSortNumbers(items, i, depthLimit);
+      items += i;
+      count -= i;
+    } else {
+      introSortNumbers(items + i, count - i, depthLimit);
+      count = i;
+    }
+  }
+}
+
+// Sorts a list holding only numbers without calling back into the VM.
+// NaN, which is unordered, goes last.
+static void sortNumbers(ValueArray *array) {
+  int count = array->count;
+  double *items = ALLOCATE(double, count);
+
+  int ordered = 0;
+  Value nan = NIL_VAL;
+  for (int i = 0; i < count; i++) {
+    double number = AS_NUMBER(array->values[i]);
+    if (number != number) {
+      nan = array->values[i];
+    } else {
+      items[ordered++] = number;
+    }
+  }
+
+  int depthLimit = 0;
+  for (int n = ordered; n > 1; n >>= 1) {
+    depthLimit += 2;
+  }
+  introSortNumbers(items, ordered, depthLimit);
+  insertionSortNumbers(items, ordered);
+
+  for (int i = 0; i < ordered; i++) {
+    array->values[i] = NUMBER_VAL(items[i]);
+  }
+  for (int i = ordered; i < count; i++) {
+    array->values[i] = nan;
+  }
+
+  FREE_ARRAY(double, items, count);
+}
+
+// Sets *order to a negative number, zero or a positive number as a sorts
+// before, with or after b. Without a comparator the items are strings and
+// compare bytewise. Returns false if the comparator raised an error.
+static bool compareItems(Value comparator, Value a, Value b, double *order) {
+  if (IS_NIL(comparator)) {
+    ObjString *left = AS_STRING(a);
+    ObjString *right = AS_STRING(b);
+    int length = left->length < right->length ? left->length : right->length;
+    int result = memcmp(left->chars, right->chars, length);
+    *order = result != 0 ? result : left->length - right->length;
+    return true;
+  }
+
+  push(comparator);
+  push(a);
+  push(b);
+  if (!callFromNative(2))
+    return false;
+
+  Value result = pop();
+  if (!IS_NUMBER(result)) {
+    runtimeError("listSort() comparator must return a number.");
+    return false;
+  }
+  *order = AS_NUMBER(result);
+  return true;
+}
+
+// Stable merge sort of items[0..count), using scratch as the merge buffer.
+// Runs are built by insertion, and two runs already in order are not
+// merged, so sorted input takes one comparison per item.
+static bool mergeSortValues(Value comparator, Value *items, Value *scratch,
+                            int count) {
+  double order;
+  if (count <= SORT_INSERTION_LIMIT) {
+    for (int i = 1; i < count; i++) {
+      Value item = items[i];
+      int j = i;
+      while (j > 0) {
+        if (!compareItems(comparator, items[j - 1], item, &order))
+          return false;
+        if (order <= 0)
+          break;
+        items[j] = items[j - 1];
+        j--;
+      }
+      items[j] = item;
+    }
+    return true;
+  }
+
+  int middle = count / 2;
+  if (!mergeSortValues(comparator, items, scratch, middle) ||
+      !mergeSortValues(comparator, items + middle, scratch, count - middle)) {
+    return false;
+  }
+
+  if (!compareItems(comparator, items[middle - 1], items[middle], &order))
+    return false;
+  if (order <= 0)
+    return true;
+
+  memcpy(scratch, items, sizeof(Value) * middle);
+  int left = 0;
+  int right = middle;
+  int out = 0;
+  while (left < middle && right < count) {
+    if (!compareItems(comparator, scratch[left], items[right], &order))
+      return false;
+    if (order <= 0) {
+      items[out++] = scratch[left++];
+    } else {
+      items[out++] = items[right++];
+    }
+  }
+  while (left < middle) {
+    items[out++] = scratch[left++];
+  }
+  return true;
+}
+
+// Native 'listSort' function: sorts a list in place and returns it. Without
+// a comparator the list must hold only numbers or only strings. A comparator
+// is called as compare(a, b) and returns a negative number, zero or a
+// positive number as a sorts before, with or after b. The sort is stable.
+static Value listSortNative(int argCount, Value *args) {
+  if (argCount != 1 && argCount != 2) {
+    runtimeError("listSort() takes 1 or 2 arguments (%d given).", argCount);
+    return NIL_VAL;
+  }
+  if (!IS_LIST(args[0])) {
+    runtimeError("listSort() first argument must be a list.");
+    return NIL_VAL;
+  }
+
+  // Calling the comparator may move the stack, so args is not used after.
+  Value listValue = args[0];
+  ObjList *list = AS_LIST(listValue);
+  ValueArray *array = list->items;
+  int count = array->count;
+  Value comparator = argCount == 2 ? args[1] : NIL_VAL;
+  if (count < 2)
+    return listValue;
+
+  if (IS_NIL(comparator)) {
+    bool numbers = true;
+    bool strings = true;
+    for (int i = 0; i < count; i++) {
+      numbers = numbers && IS_NUMBER(array->values[i]);
+      strings = strings && IS_STRING(array->values[i]);
+    }
+    if (numbers) {
+      sortNumbers(array);
+      return listValue;
+    }
+    if (!strings) {
+      runtimeError("listSort() needs a comparator unless the list holds only "
+                   "numbers or only strings.");
+      return NIL_VAL;
+    }
+  }
+
+  // The comparator may run code that changes the list or collects garbage,
+  // so the sort works on a copy. The items stay reachable through a second
+  // list kept on the stack until the result is copied back.
+  ObjList *keep = newList();
+  push(OBJ_VAL(keep));
+  for (int i = 0; i < count; i++) {
+    writeValueArray(keep->items, array->values[i]);
+  }
+  Value *items = ALLOCATE(Value, count);
+  Value *scratch = ALLOCATE(Value, count / 2 + 1);
+  memcpy(items, keep->items->values, sizeof(Value) * count);
+
+  bool sorted = mergeSortValues(comparator, items, scratch, count);
+  if (sorted && list->items->count != count) {
+    runtimeError("listSort() list was changed by the comparator.");
+    sorted = false;
+  }
+  if (sorted) {
+    memcpy(list->items->values, items, sizeof(Value) * count);
+    WRITE_BARRIER(list);
+  }
+
+  FREE_ARRAY(Value, items, count);
+  FREE_ARRAY(Value, scratch, count / 2 + 1);
+  if (!sorted)
+    return NIL_VAL; // runtimeError() has already reset the stack.
+  pop();
+  return listValue;
+}
+
 // Native 'endsWith' function: checks if a string ends with a given suffix.
 static Value endsWithNative(int argCount, Value *args) {
   if (argCount != 2) {
@@ -334,9 +627,6 @@ static Value toNumNative(int argCount, Value *args) {
   }
 
   ObjString *string = AS_STRING(args[0]);
-  if (string->chars == NULL) {
-    return NIL_VAL;
-  }
 
   char *end = NULL;
   double number = strtod(string->chars, &end);
@@ -369,9 +659,6 @@ static Value trimNative(int argCount, Value *args) {
   }
 
   ObjString *string = AS_STRING(args[0]);
-  if (string->chars == NULL) {
-    return NIL_VAL;
-  }
 
   char *source = string->chars;
   char *end = source + string->length - 1;
@@ -391,7 +678,7 @@ static Value trimNative(int argCount, Value *args) {
     return NIL_VAL;
   }
 
-  return OBJ_VAL(copyString(source, (int)len));
+  return OBJ_VAL(newStringCopy(source, (int)len));
 }
 
 // Native 'toUpperCase' function: converts a string to uppercase.
@@ -407,17 +694,13 @@ static Value toUpperCaseNative(int argCount, Value *args) {
   }
 
   ObjString *string = AS_STRING(args[0]);
-  if (string->chars == NULL) {
-    return NIL_VAL;
-  }
 
-  char *newChars = ALLOCATE(char, (size_t)string->length + 1);
+  ObjString *result = newString(string->length);
   for (int i = 0; i < string->length; i++) {
-    newChars[i] = (char)toupper((unsigned char)string->chars[i]);
+    result->chars[i] = (char)toupper((unsigned char)string->chars[i]);
   }
-  newChars[string->length] = '\0';
 
-  return OBJ_VAL(takeString(newChars, string->length));
+  return OBJ_VAL(result);
 }
 
 // Native 'toLowerCase' function: converts a string to lowercase.
@@ -433,17 +716,103 @@ static Value toLowerCaseNative(int argCount, Value *args) {
   }
 
   ObjString *string = AS_STRING(args[0]);
-  if (string->chars == NULL) {
+
+  ObjString *result = newString(string->length);
+  for (int i = 0; i < string->length; i++) {
+    result->chars[i] = (char)tolower((unsigned char)string->chars[i]);
+  }
+
+  return OBJ_VAL(result);
+}
+
+// Native 'newStringBuilder' function: creates an empty string builder.
+static Value newStringBuilderNative(int argCount, Value *args) {
+  if (argCount != 0) {
+    runtimeError("newStringBuilder() takes no arguments (%d given).",
+                 argCount);
     return NIL_VAL;
   }
+  return OBJ_VAL(newStringBuilder());
+}
 
-  char *newChars = ALLOCATE(char, (size_t)string->length + 1);
-  for (int i = 0; i < string->length; i++) {
-    newChars[i] = (char)tolower((unsigned char)string->chars[i]);
+// Appends a string, or the toString() form of a number, bool or nil.
+static bool appendValue(ObjStringBuilder *builder, Value value,
+                        const char *caller) {
+  if (IS_STRING(value)) {
+    builderAppend(builder, AS_CSTRING(value), AS_STRING(value)->length);
+    return true;
+  }
+  if (IS_NUMBER(value) || IS_BOOL(value) || IS_NIL(value)) {
+    Value text = toStringNative(1, &value);
+    push(text);
+    builderAppend(builder, AS_CSTRING(text), AS_STRING(text)->length);
+    pop();
+    return true;
+  }
+
+  runtimeError("%s() can only append strings, numbers, bools and nil.",
+               caller);
+  return false;
+}
+
+// Native 'builderAppend' function: appends a value to a string builder.
+static Value builderAppendNative(int argCount, Value *args) {
+  if (argCount != 2) {
+    runtimeError("builderAppend() takes exactly 2 arguments (%d given).",
+                 argCount);
+    return NIL_VAL;
+  }
+  if (!IS_STRING_BUILDER(args[0])) {
+    runtimeError("builderAppend() first argument must be a string builder.");
+    return NIL_VAL;
+  }
+
+  if (!appendValue(AS_STRING_BUILDER(args[0]), args[1], "builderAppend")) {
+    return NIL_VAL;
+  }
+  return args[0];
+}
+
+// Native 'builderAppendLine' function: appends an optional value and a
+// newline to a string builder.
+static Value builderAppendLineNative(int argCount, Value *args) {
+  if (argCount != 1 && argCount != 2) {
+    runtimeError("builderAppendLine() takes 1 or 2 arguments (%d given).",
+                 argCount);
+    return NIL_VAL;
   }
-  newChars[string->length] = '\0';
+  if (!IS_STRING_BUILDER(args[0])) {
+    runtimeError(
+        "builderAppendLine() first argument must be a string builder.");
+    return NIL_VAL;
+  }
+
+  ObjStringBuilder *builder = AS_STRING_BUILDER(args[0]);
+  if (argCount == 2 && !appendValue(builder, args[1], "builderAppendLine")) {
+    return NIL_VAL;
+  }
+  builderAppend(builder, "\n", 1);
+  return args[0];
+}
 
-  return OBJ_VAL(takeString(newChars, string->length));
+// Native 'builderBuild' function: returns the builder's contents as a
+// string. The builder can keep being appended to afterwards.
+static Value builderBuildNative(int argCount, Value *args) {
+  if (argCount != 1) {
+    runtimeError("builderBuild() takes exactly 1 argument (%d given).",
+                 argCount);
+    return NIL_VAL;
+  }
+  if (!IS_STRING_BUILDER(args[0])) {
+    runtimeError("builderBuild() argument must be a string builder.");
+    return NIL_VAL;
+  }
+
+  ObjStringBuilder *builder = AS_STRING_BUILDER(args[0]);
+  if (builder->length == 0) {
+    return OBJ_VAL(copyString("", 0));
+  }
+  return OBJ_VAL(newStringCopy(builder->chars, builder->length));
 }
 
 static Value mapSetNative(int argCount, Value *args) {
@@ -456,16 +825,18 @@ static Value mapSetNative(int argCount, Value *args) {
     runtimeError("First argument to mapSet() must be a map.");
     return NIL_VAL;
   }
-  if (!IS_STRING(args[1])) {
-    runtimeError("Second argument (key) to mapSet() must be a string.");
+
+  // The canonical key replaces the argument so it stays rooted while the
+  // table grows.
+  if (!mapKey(&args[1], true)) {
+    runtimeError("NaN cannot be used as a map key.");
     return NIL_VAL;
   }
-
   ObjMap *map = AS_MAP(args[0]);
-  ObjString *key = AS_STRING(args[1]);
   Value value = args[2];
 
-  tableSet(&map->table, key, value);
+  mapTableSet(&map->table, args[1], value);
+  WRITE_BARRIER(map);
   return value;
 }
 
@@ -478,16 +849,12 @@ static Value mapGetNative(int argCount, Value *args) {
     runtimeError("First argument to mapGet() must be a map.");
     return NIL_VAL;
   }
-  if (!IS_STRING(args[1])) {
-    runtimeError("Second argument (key) to mapGet() must be a string.");
-    return NIL_VAL;
-  }
 
   ObjMap *map = AS_MAP(args[0]);
-  ObjString *key = AS_STRING(args[1]);
+  Value key = args[1];
   Value value;
 
-  if (!tableGet(&map->table, key, &value)) {
+  if (!mapKey(&key, false) || !mapTableGet(&map->table, key, &value)) {
     return NIL_VAL;
   }
 
@@ -504,21 +871,187 @@ static Value mapDeleteNative(int argCount, Value *args) {
     runtimeError("First argument to mapDelete() must be a map.");
     return NIL_VAL;
   }
-  if (!IS_STRING(args[1])) {
-    runtimeError("Second argument (key) to mapDelete() must be a string.");
-    return NIL_VAL;
-  }
 
   ObjMap *map = AS_MAP(args[0]);
-  ObjString *key = AS_STRING(args[1]);
+  Value key = args[1];
 
-  if (tableDelete(&map->table, key)) {
+  if (mapKey(&key, false) && mapTableDelete(&map->table, key)) {
     return BOOL_VAL(true);
   }
 
   return BOOL_VAL(false);
 }
 
+static Value mapSizeNative(int argCount, Value *args) {
+  if (argCount != 1) {
+    runtimeError("mapSize() takes 1 argument: map (%d given).", argCount);
+    return NIL_VAL;
+  }
+  if (!IS_MAP(args[0])) {
+    runtimeError("First argument to mapSize() must be a map.");
+    return NIL_VAL;
+  }
+
+  return NUMBER_VAL(AS_MAP(args[0])->table.count);
+}
+
+typedef enum { MAP_KEYS, MAP_VALUES, MAP_ENTRIES } MapListKind;
+
+// Collects the keys, the values or [key, value] pairs of a map into a new
+// list, in slot order.
+static Value mapToList(ObjMap *map, MapListKind kind) {
+  ObjList *list = newList();
+  push(OBJ_VAL(list));
+
+  MapTable *table = &map->table;
+  for (int slot = mapTableNext(table, -1); slot >= 0;
+       slot = mapTableNext(table, slot)) {
+    Value item;
+    if (kind == MAP_KEYS) {
+      item = table->keys[slot];
+    } else if (kind == MAP_VALUES) {
+      item = table->values[slot];
+    } else {
+      ObjList *pair = newList();
+      push(OBJ_VAL(pair));
+      writeValueArray(pair->items, table->keys[slot]);
+      writeValueArray(pair->items, table->values[slot]);
+      WRITE_BARRIER(pair);
+      item = OBJ_VAL(pair);
+    }
+
+    writeValueArray(list->items, item);
+    WRITE_BARRIER(list);
+    if (kind == MAP_ENTRIES) pop();
+  }
+
+  pop();
+  return OBJ_VAL(list);
+}
+
+static Value mapKeysNative(int argCount, Value *args) {
+  if (argCount != 1 || !IS_MAP(args[0])) {
+    runtimeError("mapKeys() takes 1 argument: map.");
+    return NIL_VAL;
+  }
+  return mapToList(AS_MAP(args[0]), MAP_KEYS);
+}
+
+static Value mapValuesNative(int argCount, Value *args) {
+  if (argCount != 1 || !IS_MAP(args[0])) {
+    runtimeError("mapValues() takes 1 argument: map.");
+    return NIL_VAL;
+  }
+  return mapToList(AS_MAP(args[0]), MAP_VALUES);
+}
+
+static Value mapEntriesNative(int argCount, Value *args) {
+  if (argCount != 1 || !IS_MAP(args[0])) {
+    runtimeError("mapEntries() takes 1 argument: map.");
+    return NIL_VAL;
+  }
+  return mapToList(AS_MAP(args[0]), MAP_ENTRIES);
+}
+
+// Native 'mapMerge' function: copies every entry of the second map into the
+// first, replacing existing keys, and returns the first.
+static Value mapMergeNative(int argCount, Value *args) {
+  if (argCount != 2 || !IS_MAP(args[0]) || !IS_MAP(args[1])) {
+    runtimeError("mapMerge() takes 2 arguments: target map, source map.");
+    return NIL_VAL;
+  }
+
+  ObjMap *target = AS_MAP(args[0]);
+  mapTableAddAll(&AS_MAP(args[1])->table, &target->table);
+  WRITE_BARRIER(target);
+  return args[0];
+}
+
+// Reads a cursor argument for mapNext/mapKeyAt/mapValueAt. Returns -1 and
+// reports an error when it does not name an occupied slot.
+static int mapCursor(const char *native, ObjMap *map, Value cursor) {
+  if (IS_NUMBER(cursor)) {
+    double number = AS_NUMBER(cursor);
+    if (number >= 0 && number < map->table.capacity) {
+      int slot = (int)number;
+      if (slot == number && mapTableNext(&map->table, slot - 1) == slot) {
+        return slot;
+      }
+    }
+  }
+  runtimeError("Invalid cursor passed to %s().", native);
+  return -1;
+}
+
+// Native 'mapNext' function: steps a cursor through a map without building
+// a list. Pass nil to start; returns nil after the last entry. Deleting
+// entries while iterating is fine; adding them may reorder the rest.
+static Value mapNextNative(int argCount, Value *args) {
+  if (argCount != 2 || !IS_MAP(args[0])) {
+    runtimeError("mapNext() takes 2 arguments: map, cursor.");
+    return NIL_VAL;
+  }
+
+  MapTable *table = &AS_MAP(args[0])->table;
+  int slot = -1;
+  if (!IS_NIL(args[1])) {
+    if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 0) {
+      runtimeError("Invalid cursor passed to mapNext().");
+      return NIL_VAL;
+    }
+    if (AS_NUMBER(args[1]) >= table->capacity) return NIL_VAL;
+    slot = (int)AS_NUMBER(args[1]);
+  }
+
+  int next = mapTableNext(table, slot);
+  return next < 0 ? NIL_VAL : NUMBER_VAL(next);
+}
+
+static Value mapKeyAtNative(int argCount, Value *args) {
+  if (argCount != 2 || !IS_MAP(args[0])) {
+    runtimeError("mapKeyAt() takes 2 arguments: map, cursor.");
+    return NIL_VAL;
+  }
+  ObjMap *map = AS_MAP(args[0]);
+  int slot = mapCursor("mapKeyAt", map, args[1]);
+  return slot < 0 ? NIL_VAL : map->table.keys[slot];
+}
+
+static Value mapValueAtNative(int argCount, Value *args) {
+  if (argCount != 2 || !IS_MAP(args[0])) {
+    runtimeError("mapValueAt() takes 2 arguments: map, cursor.");
+    return NIL_VAL;
+  }
+  ObjMap *map = AS_MAP(args[0]);
+  int slot = mapCursor("mapValueAt", map, args[1]);
+  return slot < 0 ? NIL_VAL : map->table.values[slot];
+}
+
+static Value mapReserveNative(int argCount, Value *args) {
+  if (argCount != 2) {
+    runtimeError("mapReserve() takes 2 arguments: map, count (%d given).",
+                 argCount);
+    return NIL_VAL;
+  }
+  if (!IS_MAP(args[0])) {
+    runtimeError("First argument to mapReserve() must be a map.");
+    return NIL_VAL;
+  }
+  if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 0 ||
+      AS_NUMBER(args[1]) > INT32_MAX / 2) {
+    runtimeError("Second argument (count) to mapReserve() must be a "
+                 "non-negative number.");
+    return NIL_VAL;
+  }
+
+  if (!mapTableReserve(&AS_MAP(args[0])->table, (int)AS_NUMBER(args[1]))) {
+    runtimeError("Cannot reserve room for %.0f keys in a map.",
+                 AS_NUMBER(args[1]));
+    return NIL_VAL;
+  }
+  return args[0];
+}
+
 VM vm;
 
 // Forward declaration for the runtime error function.
@@ -548,11 +1081,8 @@ static Value inputNative(int argCount, Value *args) {
   if (argCount == 1) {
     Value prompt = args[0];
     if (IS_STRING(prompt)) {
-      ObjString *str = AS_STRING(prompt);
-      if (str->chars != NULL) {
-        printf("%s", str->chars);
-        fflush(stdout);
-      }
+      printf("%s", AS_CSTRING(prompt));
+      fflush(stdout);
     } else {
       runtimeError("input() argument must be a string.");
       return NIL_VAL;
@@ -572,7 +1102,7 @@ static Value inputNative(int argCount, Value *args) {
     buffer[sizeof(buffer) - 1] = '\0';
   }
 
-  return OBJ_VAL(copyString(buffer, (int)strlen(buffer)));
+  return OBJ_VAL(newStringCopy(buffer, (int)strlen(buffer)));
 }
 
 // Helper function to recursively walk a directory.
@@ -610,8 +1140,11 @@ static void walk(const char *dir, ObjList *list) {
       if (name_len > INT_MAX) {
         continue;
       }
-      Value pathValue = OBJ_VAL(copyString(dp->d_name, (int)name_len));
+      Value pathValue = OBJ_VAL(newStringCopy(dp->d_name, (int)name_len));
+      push(pathValue);
       writeValueArray(list->items, pathValue);
+      WRITE_BARRIER(list);
+      pop();
     }
   }
   closedir(dfd);
@@ -928,7 +1461,7 @@ static Value systemNative(int argCount, Value *args) {
   }
 
   ObjString *cmdStr = AS_STRING(args[0]);
-  if (cmdStr->chars == NULL || cmdStr->length == 0) {
+  if (cmdStr->length == 0) {
     runtimeError("system() command cannot be empty.");
     return NIL_VAL;
   }
@@ -984,7 +1517,7 @@ static Value systemNative(int argCount, Value *args) {
 
   pclose(pipe);
 
-  ObjString *output = copyString(result, (int)total_size);
+  ObjString *output = newStringCopy(result, (int)total_size);
   free(result);
   return OBJ_VAL(output);
 }
@@ -1107,19 +1640,91 @@ bool hasValidExtension(const char *filename, ObjList *extensions) {
 
 // --- VM Internals ---
 
+// Makes room for at least needed values above stackTop. The stack is
+// copied to a new block and every frame's slots are moved with it.
+static void growStack(int needed) {
+  int used = (int)(vm.stackTop - vm.stack);
+  int capacity = vm.stackCapacity;
+  while (capacity - used < needed) {
+    capacity *= 2;
+  }
+
+  Value *stack = (Value *)malloc(sizeof(Value) * capacity);
+  if (stack == NULL) {
+    fprintf(stderr, "Not enough memory to grow the stack.\n");
+    exit(1);
+  }
+  memcpy(stack, vm.stack, sizeof(Value) * used);
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+  }
+  free(vm.stack);
+
+  vm.stack = stack;
+  vm.stackTop = stack + used;
+  vm.stackCapacity = capacity;
+}
+
+static void growFrames() {
+  int capacity = vm.frameCapacity * 2;
+  if (capacity > vm.maxFrames) {
+    capacity = vm.maxFrames;
+  }
+
+  CallFrame *frames =
+      (CallFrame *)realloc(vm.frames, sizeof(CallFrame) * capacity);
+  if (frames == NULL) {
+    fprintf(stderr, "Not enough memory to grow the call stack.\n");
+    exit(1);
+  }
+  vm.frames = frames;
+  vm.frameCapacity = capacity;
+}
+
 void resetStack() {
   vm.stackTop = vm.stack;
   vm.frameCount = 0;
+  vm.baseFrame = 0;
 }
 
 // This function is now defined in error.c to be shared across the codebase.
 // We keep the declaration here to avoid modifying all native function calls.
 void runtimeError(const char *format, ...);
 
+// Returns the slot for a global, creating an undefined one the first time
+// the name is seen. Code may refer to a global before it is defined.
+int globalSlot(ObjString *name) {
+  Value slot;
+  if (tableGet(&vm.globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+
+  push(OBJ_VAL(name));
+  int index = vm.globalValues.count;
+  writeValueArray(&vm.globalNames, OBJ_VAL(name));
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
+  pop();
+  return index;
+}
+
+bool getGlobal(ObjString *name, Value *value) {
+  Value slot;
+  if (!tableGet(&vm.globalSlots, name, &slot)) return false;
+  Value global = vm.globalValues.values[(int)AS_NUMBER(slot)];
+  if (IS_UNDEFINED(global)) return false;
+  *value = global;
+  return true;
+}
+
+// value must be reachable by the GC, since creating the slot can allocate.
+void setGlobal(ObjString *name, Value value) {
+  int slot = globalSlot(name);
+  vm.globalValues.values[slot] = value;
+}
+
 void defineNative(const char *name, NativeFn function) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  setGlobal(AS_STRING(vm.stack[0]), vm.stack[1]);
 
   pop();
   pop();
@@ -1128,22 +1733,43 @@ void defineNative(const char *name, NativeFn function) {
 void defineGlobal(const char *name, Value value) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(value);
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  setGlobal(AS_STRING(vm.stack[0]), vm.stack[1]);
   pop();
   pop();
 }
 
 void initVM() {
+  vm.frames = (CallFrame *)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+  vm.frameCapacity = FRAMES_INITIAL;
+  vm.maxFrames = FRAMES_MAX;
   vm.frameCount = 0;
+  vm.baseFrame = 0;
+  vm.stack = (Value *)malloc(sizeof(Value) * STACK_INITIAL);
+  vm.stackCapacity = STACK_INITIAL;
   vm.stackTop = vm.stack;
+  if (vm.frames == NULL || vm.stack == NULL) {
+    fprintf(stderr, "Not enough memory for the stack.\n");
+    exit(1);
+  }
   vm.objects = NULL;
+  vm.youngObjects = NULL;
   vm.hadError = false;
   vm.bytesAllocated = 0;
   vm.nextGC = 1024 * 1024;
+  vm.grayCount = 0;
+  vm.grayCapacity = 0;
+  vm.grayStack = NULL;
+  vm.nurseryBytes = 0;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.remembered = NULL;
   vm.enable_preflight = false;
+  vm.moduleCache = true;
   vm.instruction_count = 0;
 
-  initTable(&vm.globals);
+  initTable(&vm.globalSlots);
+  initValueArray(&vm.globalValues);
+  initValueArray(&vm.globalNames);
   initTable(&vm.modules);
   initTable(&vm.strings);
   initProfiler(&vm.profiler);
@@ -1172,6 +1798,7 @@ void initVM() {
   defineNative("dictGet", dictGetNative);
   defineNative("dictDelete", dictDeleteNative);
   defineNative("dictExists", dictExistsNative);
+  defineNative("dictReserve", dictReserveNative);
   defineNative("lines", countLinesNative);
   defineNative("listLen", listLenNative);
   defineNative("listGet", listGetNative);
@@ -1180,12 +1807,22 @@ void initVM() {
   defineNative("listPop", listPopNative);
   defineNative("listClear", listClearNative);
   defineNative("listShift", listShiftNative);
+  defineNative("listSort", listSortNative);
   defineNative("endsWith", endsWithNative);
   defineNative("toNum", toNumNative);
   defineNative("map", mapNative);
   defineNative("mapSet", mapSetNative);
   defineNative("mapGet", mapGetNative);
   defineNative("mapDelete", mapDeleteNative);
+  defineNative("mapReserve", mapReserveNative);
+  defineNative("mapSize", mapSizeNative);
+  defineNative("mapKeys", mapKeysNative);
+  defineNative("mapValues", mapValuesNative);
+  defineNative("mapEntries", mapEntriesNative);
+  defineNative("mapMerge", mapMergeNative);
+  defineNative("mapNext", mapNextNative);
+  defineNative("mapKeyAt", mapKeyAtNative);
+  defineNative("mapValueAt", mapValueAtNative);
   defineNative("analyze", analyzeNative);
   defineNative("system", systemNative);
 
@@ -1210,23 +1847,32 @@ void initVM() {
   defineNative("trim", trimNative);
   defineNative("toUpperCase", toUpperCaseNative);
   defineNative("toLowerCase", toLowerCaseNative);
+  defineNative("newStringBuilder", newStringBuilderNative);
+  defineNative("builderAppend", builderAppendNative);
+  defineNative("builderAppendLine", builderAppendLineNative);
+  defineNative("builderBuild", builderBuildNative);
 
   initMathLibrary();
   initRandomLibrary();
 }
 
 void freeVM() {
-  freeTable(&vm.globals);
+  freeTable(&vm.globalSlots);
+  freeValueArray(&vm.globalValues);
+  freeValueArray(&vm.globalNames);
   freeTable(&vm.modules);
   freeTable(&vm.strings);
   freeObjects();
+  freeImages();
   freeProfiler(&vm.profiler);
+  freePools();
+  free(vm.frames);
+  free(vm.stack);
 }
 
 void push(Value value) {
-  if (vm.stackTop >= vm.stack + STACK_MAX) {
-    fprintf(stderr, "Stack overflow\n");
-    exit(1);
+  if (vm.stackTop == vm.stack + vm.stackCapacity) {
+    growStack(1);
   }
   *vm.stackTop = value;
   vm.stackTop++;
@@ -1254,30 +1900,54 @@ static bool isFalsey(Value value) {
          (IS_NUMBER(value) && AS_NUMBER(value) == 0);
 }
 
-static void concatenate() {
-  ObjString *b = AS_STRING(peek(0));
-  ObjString *a = AS_STRING(peek(1));
+static bool isStringValue(Value value) {
+  return IS_STRING(value) || IS_ROPE(value);
+}
 
-  if (a->chars == NULL || b->chars == NULL) {
-    runtimeError("Cannot concatenate null strings.");
-    return;
+static int stringValueLength(Value value) {
+  return IS_ROPE(value) ? AS_ROPE(value)->length : AS_STRING(value)->length;
+}
+
+// Replaces a rope in a stack slot with its flattened string. The slot must
+// be below vm.stackTop so the rope stays rooted while flattening.
+static void flattenSlot(Value *slot) {
+  if (IS_ROPE(*slot)) {
+    *slot = OBJ_VAL(flattenRope(AS_ROPE(*slot)));
   }
+}
+
+// Short results are copied and interned right away. Longer ones become a
+// rope so that appending in a loop is linear instead of quadratic.
+static void concatenate() {
+  Value b = peek(0);
+  Value a = peek(1);
+  int aLength = stringValueLength(a);
+  int bLength = stringValueLength(b);
 
-  if (a->length > INT_MAX - b->length) {
+  if (aLength > INT_MAX - bLength) {
     runtimeError("String concatenation overflow.");
     return;
   }
 
-  int length = a->length + b->length;
-  char *chars = ALLOCATE(char, (size_t)length + 1);
-  memcpy(chars, a->chars, (size_t)a->length);
-  memcpy(chars + a->length, b->chars, (size_t)b->length);
-  chars[length] = '\0';
+  int length = aLength + bLength;
+  Value result;
+  if (bLength == 0) {
+    result = a;
+  } else if (aLength == 0) {
+    result = b;
+  } else if (length < ROPE_MIN_LENGTH) {
+    // Ropes are never shorter than ROPE_MIN_LENGTH, so both are strings.
+    ObjString *string = newString(length);
+    memcpy(string->chars, AS_CSTRING(a), (size_t)aLength);
+    memcpy(string->chars + aLength, AS_CSTRING(b), (size_t)bLength);
+    result = OBJ_VAL(string);
+  } else {
+    result = OBJ_VAL(newRope(AS_OBJ(a), AS_OBJ(b), length));
+  }
 
-  ObjString *result = takeString(chars, length);
   pop();
   pop();
-  push(OBJ_VAL(result));
+  push(result);
 }
 
 static bool call(ObjFunction *function, int argCount) {
@@ -1287,15 +1957,59 @@ static bool call(ObjFunction *function, int argCount) {
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
+  if (function->image != NULL && !linkFunction(function)) {
+    runtimeError("Could not load %s from its bytecode image.",
+                 function->name == NULL ? "script" : function->name->chars);
+    return false;
+  }
+
+  if (vm.frameCount == vm.maxFrames) {
     runtimeError("Stack overflow.");
     return false;
   }
+  if (vm.frameCount == vm.frameCapacity) {
+    growFrames();
+  }
+
+  int needed = function->maxStackDepth + STACK_SLACK - argCount - 1;
+  if (vm.stack + vm.stackCapacity - vm.stackTop < needed) {
+    growStack(needed);
+  }
+  Value *slots = vm.stackTop - argCount - 1;
 
   CallFrame *frame = &vm.frames[vm.frameCount++];
   frame->function = function;
   frame->ip = function->chunk.code;
-  frame->slots = vm.stackTop - argCount - 1;
+  frame->slots = slots;
+  return true;
+}
+
+// Replaces the running frame with a call to function. The callee and its
+// arguments are moved down over the frame's slots.
+static bool tailCall(ObjFunction *function, int argCount) {
+  if (argCount != function->arity) {
+    runtimeError("Expected %d arguments but got %d.", function->arity,
+                 argCount);
+    return false;
+  }
+
+  if (function->image != NULL && !linkFunction(function)) {
+    runtimeError("Could not load %s from its bytecode image.",
+                 function->name == NULL ? "script" : function->name->chars);
+    return false;
+  }
+
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  memmove(frame->slots, vm.stackTop - argCount - 1,
+          sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+
+  int needed = function->maxStackDepth + STACK_SLACK - argCount - 1;
+  if (vm.stack + vm.stackCapacity - vm.stackTop < needed) {
+    growStack(needed);
+  }
+  frame->function = function;
+  frame->ip = function->chunk.code;
   return true;
 }
 
@@ -1305,6 +2019,10 @@ static bool callValue(Value callee, int argCount) {
     case OBJ_FUNCTION:
       return call(AS_FUNCTION(callee), argCount);
     case OBJ_NATIVE: {
+      // Natives only ever see flat strings.
+      for (Value *arg = vm.stackTop - argCount; arg < vm.stackTop; arg++) {
+        flattenSlot(arg);
+      }
       NativeFn native = AS_NATIVE(callee);
       Value result = native(argCount, vm.stackTop - argCount);
       if (vm.hadError)
@@ -1321,473 +2039,68 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
-static InterpretResult run() {
-  CallFrame *frame = &vm.frames[vm.frameCount - 1];
-
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-
-#define BINARY_OP(valueType, op)                                               \
-  do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtimeError("Operands must be numbers.");                               \
-      return INTERPRET_RUNTIME_ERROR;                                          \
-    }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(valueType(a op b));                                                   \
-  } while (false)
-
-  for (;;) {
-    if (vm.profiler.profiling_mode) {
-      vm.instruction_count++;
-
-      if (vm.instruction_count % 10000 == 0) {
-        if (checkTimeout(&vm.profiler)) {
-          if (vm.profiler.infinite_loop_detected) {
-            fprintf(stderr,
-                    "Preflight aborted: potential infinite loop detected\n");
-          } else {
-            fprintf(stderr, "Preflight aborted: timeout exceeded\n");
-          }
-          return INTERPRET_RUNTIME_ERROR;
-        }
-      }
-
-      if (!checkRecursionDepth(&vm.profiler, vm.frameCount)) {
-        fprintf(stderr, "Preflight aborted: excessive recursion depth\n");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-
-      size_t stack_depth = (size_t)(vm.stackTop - vm.stack);
-      if (stack_depth > vm.profiler.max_stack_depth) {
-        vm.profiler.max_stack_depth = stack_depth;
-      }
-    }
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(&frame->function->chunk,
-                           (int)(frame->ip - frame->function->chunk.code));
-#endif
-
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-    case OP_CONSTANT: {
-      Value constant = READ_CONSTANT();
-      push(constant);
-      break;
-    }
-    case OP_NIL:
-      push(NIL_VAL);
-      break;
-    case OP_TRUE:
-      push(BOOL_VAL(true));
-      break;
-    case OP_FALSE:
-      push(BOOL_VAL(false));
-      break;
-    case OP_POP:
-      pop();
-      break;
-    case OP_GET_LOCAL: {
-      uint8_t slot = READ_BYTE();
-      if (frame->slots + slot >= vm.stackTop) {
-        runtimeError("Local variable access out of bounds.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      push(frame->slots[slot]);
-      break;
-    }
-    case OP_SET_LOCAL: {
-      uint8_t slot = READ_BYTE();
-      if (frame->slots + slot >= vm.stackTop) {
-        runtimeError("Local variable assignment out of bounds.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      frame->slots[slot] = peek(0);
-      break;
-    }
-    case OP_GET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      push(value);
-      break;
-    }
-
-    case OP_SET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      if (tableSet(&vm.globals, name, peek(0))) {
-        tableDelete(&vm.globals, name);
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      break;
-    }
-    case OP_EXPORT_VAR: {
-      ObjString *name = READ_STRING();
-      Value value;
-      // Check if the variable is in the globals table first.
-      if (tableGet(&vm.globals, name, &value)) {
-        tableSet(&frame->function->module->variables, name, value);
-      } else {
-        // Fallback to the stack for locally-defined exports.
-        tableSet(&frame->function->module->variables, name, peek(0));
-      }
-      break;
-    }
-    case OP_DEFINE_GLOBAL: {
-      ObjString *name = READ_STRING();
-      tableSet(&vm.globals, name, peek(0));
-      pop();
-      break;
-    }
-    case OP_EQUAL: {
-      Value b = peek(0);
-      Value a = peek(1);
-      vm.stackTop -= 2;
-      push(BOOL_VAL(valuesEqual(a, b)));
-      break;
-    }
-    case OP_GREATER: {
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
-        runtimeError("Operands must be numbers.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      double b = AS_NUMBER(peek(0));
-      double a = AS_NUMBER(peek(1));
-      vm.stackTop -= 2;
-      push(BOOL_VAL(a > b));
-      break;
-    }
-    case OP_LESS: {
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
-        runtimeError("Operands must be numbers.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      double b = AS_NUMBER(peek(0));
-      double a = AS_NUMBER(peek(1));
-      vm.stackTop -= 2;
-      push(BOOL_VAL(a < b));
-      break;
-    }
-    case OP_ADD: {
-      Value b = peek(0);
-      Value a = peek(1);
-      if (IS_NUMBER(a) && IS_NUMBER(b)) {
-        double result = AS_NUMBER(a) + AS_NUMBER(b);
-        vm.stackTop -= 2;
-        push(NUMBER_VAL(result));
-      } else if (IS_STRING(a) && IS_STRING(b)) {
-        concatenate();
-      } else {
-        runtimeError("Operands must be two numbers or two strings.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      break;
-    }
-    case OP_SUBTRACT: {
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
-        runtimeError("Operands must be numbers.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      double b = AS_NUMBER(peek(0));
-      double a = AS_NUMBER(peek(1));
-      vm.stackTop -= 2;
-      push(NUMBER_VAL(a - b));
-      break;
-    }
-    case OP_MULTIPLY: {
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
-        runtimeError("Operands must be numbers.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      double b = AS_NUMBER(peek(0));
-      double a = AS_NUMBER(peek(1));
-      vm.stackTop -= 2;
-      push(NUMBER_VAL(a * b));
-      break;
-    }
-    case OP_DIVIDE: {
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
-        runtimeError("Operands must be numbers.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      double b = AS_NUMBER(peek(0));
-      double a = AS_NUMBER(peek(1));
-      if (b == 0.0) {
-        runtimeError("Division by zero.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      vm.stackTop -= 2;
-      push(NUMBER_VAL(a / b));
-      break;
-    }
-    case OP_MODULO: {
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
-        runtimeError("Operands must be numbers.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      double b = AS_NUMBER(peek(0));
-      double a = AS_NUMBER(peek(1));
-      if (b == 0.0) {
-        runtimeError("Modulo by zero.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      vm.stackTop -= 2;
-      push(NUMBER_VAL(fmod(a, b)));
-      break;
-    }
-    case OP_NOT: {
-      Value val = peek(0);
-      vm.stackTop[-1] = BOOL_VAL(isFalsey(val));
-      break;
-    }
-    case OP_NEGATE: {
-      if (!IS_NUMBER(peek(0))) {
-        runtimeError("Operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      Value val = peek(0);
-      vm.stackTop[-1] = NUMBER_VAL(-AS_NUMBER(val));
-      break;
-    }
-    case OP_PRINT: {
-      Value val = pop();
-      if (vm.profiler.profiling_mode) {
-        vm.profiler.output_operations++;
-      } else {
-        printValue(val);
-        printf("\n");
-      }
-      break;
-    }
-    case OP_JUMP: {
-      uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
-    }
-    case OP_JUMP_IF_FALSE: {
-      uint16_t offset = READ_SHORT();
-      if (isFalsey(peek(0)))
-        frame->ip += offset;
-      break;
-    }
-    case OP_LOOP: {
-      uint16_t offset = READ_SHORT();
-
-      if (vm.profiler.profiling_mode) {
-        uint64_t loop_id = (uint64_t)(frame->ip - frame->function->chunk.code);
-        frame->loop_counter++;
-
-        recordLoopIteration(&vm.profiler, loop_id);
-
-        size_t stack_depth = (size_t)(vm.stackTop - vm.stack);
-        if (!checkLoopSafety(&vm.profiler, loop_id, stack_depth)) {
-          fprintf(stderr,
-                  "Preflight: Loop appears infinite (no progress after %d "
-                  "iterations)\n",
-                  MAX_LOOP_ITERATIONS);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-      }
-
-      frame->ip -= offset;
-      break;
-    }
-    case OP_CALL: {
-      int argCount = READ_BYTE();
-      if (!callValue(peek(argCount), argCount)) {
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
-    }
-    case OP_NEW_LIST: {
-      ObjList *list = newList();
-      push(OBJ_VAL(list));
-      break;
-    }
-    case OP_LIST_APPEND: {
-      Value item = pop();
-      ObjList *list = AS_LIST(peek(0));
-      writeValueArray(list->items, item);
-      break;
-    }
-    case OP_GET_SUBSCRIPT: {
-      Value indexVal = peek(0);
-      Value listVal = peek(1);
-
-      if (!IS_LIST(listVal)) {
-        runtimeError("Can only subscript lists.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      ObjList *list = AS_LIST(listVal);
-
-      if (!IS_NUMBER(indexVal)) {
-        runtimeError("List index must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-
-      double indexDouble = AS_NUMBER(indexVal);
-      if (indexDouble != (int)indexDouble) {
-        runtimeError("List index must be an integer.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-
-      int index = (int)indexDouble;
-      if (index < 0)
-        index = list->items->count + index;
-
-      if (index < 0 || index >= list->items->count) {
-        runtimeError("List index out of bounds.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-
-      vm.stackTop -= 2;
-      push(list->items->values[index]);
-      break;
-    }
-
-    case OP_SET_SUBSCRIPT: {
-      Value value = peek(0);
-      Value indexVal = peek(1);
-      Value listVal = peek(2);
-
-      if (!IS_LIST(listVal)) {
-        runtimeError("Can only subscript lists.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      ObjList *list = AS_LIST(listVal);
-
-      if (!IS_NUMBER(indexVal)) {
-        runtimeError("List index must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-
-      double indexDouble = AS_NUMBER(indexVal);
-      if (indexDouble != (int)indexDouble) {
-        runtimeError("List index must be an integer.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-
-      int index = (int)indexDouble;
-      if (index < 0)
-        index = list->items->count + index;
+static InterpretResult run();
+static InterpretResult runProfiled();
 
-      if (index < 0 || index >= list->items->count) {
-        runtimeError("List index out of bounds.");
-        return INTERPRET_RUNTIME_ERROR;
-      }
+// Calls the callee below argCount arguments on the stack from inside a
+// native and, for a script function, runs it to completion before
+// returning. The result replaces the callee and arguments. Returns false on
+// a runtime error, after which the stack has been reset.
+static bool callFromNative(int argCount) {
+  int frameCount = vm.frameCount;
+  if (!callValue(vm.stackTop[-1 - argCount], argCount))
+    return false;
+  if (vm.frameCount == frameCount)
+    return true; // A native, which has already run.
+
+  int baseFrame = vm.baseFrame;
+  vm.baseFrame = frameCount;
+  InterpretResult result = vm.profiler.profiling_mode ? runProfiled() : run();
+  vm.baseFrame = baseFrame;
+  return result == INTERPRET_OK;
+}
 
-      list->items->values[index] = value;
-      vm.stackTop -= 3;
-      push(value);
-      break;
-    }
-    case OP_IMPORT: {
-      ObjString *moduleName = AS_STRING(pop());
-      Value moduleValue;
+// Per-instruction bookkeeping for the preflight loop. Returns false when the
+// preflight run should be aborted.
+static bool preflightStep(size_t stack_depth) {
+  vm.instruction_count++;
 
-      if (tableGet(&vm.modules, moduleName, &moduleValue)) {
-        push(moduleValue);
+  if (vm.instruction_count % 10000 == 0) {
+    if (checkTimeout(&vm.profiler)) {
+      if (vm.profiler.infinite_loop_detected) {
+        fprintf(stderr, "Preflight aborted: potential infinite loop detected\n");
       } else {
-        if (moduleName == NULL || moduleName->chars == NULL) {
-          runtimeError("Invalid module name.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        char *source = readFile(moduleName->chars);
-        if (source == NULL) {
-          runtimeError("Could not open module '%s'.", moduleName->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-
-        ObjModule *module = newModule(moduleName);
-        push(OBJ_VAL(module));
-
-        tableSet(&vm.modules, moduleName, OBJ_VAL(module));
-
-        ObjFunction *func = compile(source, module);
-        free(source);
-
-        if (func == NULL) {
-          tableDelete(&vm.modules, moduleName);
-          pop(); // Pop the module.
-          return INTERPRET_COMPILE_ERROR;
-        }
-
-        // The module is on the stack. We pop it, push the function, and call
-        // it.
-        pop(); // Pop the module.
-        push(OBJ_VAL(func));
-        call(func, 0);
-        frame = &vm.frames[vm.frameCount - 1];
-
-        // The module has been executed. Now, copy its exported variables
-        // to the global scope.
-        for (int i = 0; i < module->variables.capacity; i++) {
-          Entry *entry = &module->variables.entries[i];
-          if (entry->key != NULL) {
-            tableSet(&vm.globals, entry->key, entry->value);
-          }
-        }
-
-        // The import statement leaves the module object on the stack.
-        vm.stackTop[-1] = OBJ_VAL(module);
-      }
-      break;
-    }
-    case OP_EXPORT: {
-      ObjString *varName = READ_STRING();
-      ObjModule *module = frame->function->module;
-      if (module == NULL) {
-        runtimeError("Cannot export from top-level script.");
-        return INTERPRET_RUNTIME_ERROR;
+        fprintf(stderr, "Preflight aborted: timeout exceeded\n");
       }
-      tableSet(&module->variables, varName, peek(0));
-      // Unlike OP_DEFINE_GLOBAL, we keep the value on the stack
-      // for the export statement to use.
-      break;
+      return false;
     }
-    case OP_RETURN: {
-      Value result = pop();
-      vm.frameCount--;
-
-      if (vm.frameCount == 0) {
-        pop(); // Pop main script function.
-        return INTERPRET_OK;
-      }
-
-      vm.stackTop = frame->slots;
-      push(result);
+  }
 
-      // After returning, the current frame is the one we are returning to.
-      // We need to update our local 'frame' variable to point to it.
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
-    }
-    }
+  if (!checkRecursionDepth(&vm.profiler, vm.frameCount)) {
+    fprintf(stderr, "Preflight aborted: excessive recursion depth\n");
+    return false;
   }
 
-#undef READ_BYTE
-#undef READ_SHORT
-#undef READ_CONSTANT
-#undef READ_STRING
-#undef BINARY_OP
+  if (stack_depth > vm.profiler.max_stack_depth) {
+    vm.profiler.max_stack_depth = stack_depth;
+  }
+  return true;
 }
 
+// run() is the production interpreter loop; runProfiled() is the same loop
+// with the preflight hooks compiled in.
+#define VM_LOOP_NAME run
+#define VM_LOOP_PROFILING 0
+#include "vm_loop.inc"
+#undef VM_LOOP_NAME
+#undef VM_LOOP_PROFILING
+
+#define VM_LOOP_NAME runProfiled
+#define VM_LOOP_PROFILING 1
+#include "vm_loop.inc"
+#undef VM_LOOP_NAME
+#undef VM_LOOP_PROFILING
+
 static InterpretResult runPreflight(ObjFunction *function) {
   vm.profiler.profiling_mode = true;
   vm.profiler.preflight_complete = false;
@@ -1798,7 +2111,7 @@ static InterpretResult runPreflight(ObjFunction *function) {
   push(OBJ_VAL(function));
   call(function, 0);
 
-  InterpretResult result = run();
+  InterpretResult result = runProfiled();
 
   vm.profiler.profiling_mode = false;
   vm.profiler.preflight_complete = true;
@@ -1821,14 +2134,9 @@ static InterpretResult runOptimized(ObjFunction *function) {
   return run();
 }
 
-InterpretResult interpret(const char *path, const char *source) {
-  ObjModule *mainModule =
-      newModule(copyString(path, path == NULL ? 0 : strlen(path)));
-
-  ObjFunction *function = compile(source, mainModule);
-  if (function == NULL)
-    return INTERPRET_COMPILE_ERROR;
-
+// Runs a freshly compiled or loaded script, profiling it first when
+// --preflight is on.
+static InterpretResult runScript(ObjFunction *function) {
   if (vm.enable_preflight) {
     InterpretResult preflight_result = runPreflight(function);
 
@@ -1851,3 +2159,34 @@ InterpretResult interpret(const char *path, const char *source) {
 
   return runOptimized(function);
 }
+
+InterpretResult interpret(const char *path, const char *source) {
+  vm.hadError = false;
+
+  // Keep the module name, then the module, on the stack so a collection
+  // during compilation cannot free them.
+  push(OBJ_VAL(copyString(path, path == NULL ? 0 : strlen(path))));
+  ObjModule *mainModule = newModule(AS_STRING(peek(0)));
+  vm.stackTop[-1] = OBJ_VAL(mainModule);
+
+  ObjFunction *function = compile(source, mainModule);
+  pop();
+  if (function == NULL)
+    return INTERPRET_COMPILE_ERROR;
+
+  return runScript(function);
+}
+
+InterpretResult interpretImage(const char *path) {
+  vm.hadError = false;
+
+  ObjFunction *function = loadImage(path, NULL);
+  if (function == NULL) {
+    fprintf(stderr,
+            "Could not load \"%s\": not a bytecode image of version %d.\n",
+            path, BYTECODE_VERSION);
+    return INTERPRET_COMPILE_ERROR;
+  }
+
+  return runScript(function);
+}
@@ -8,5 +8,6 @@ Value dictSetNative(int argCount, Value* args);
 Value dictGetNative(int argCount, Value* args);
 Value dictDeleteNative(int argCount, Value* args);
 Value dictExistsNative(int argCount, Value* args);
+Value dictReserveNative(int argCount, Value* args);
 
 #endif // FLS_DICT_H
@@ -17,26 +17,32 @@ Value newDictNative(int argCount, Value* args) {
 
 // Sets a key-value pair in a dictionary.
 Value dictSetNative(int argCount, Value* args) {
-    if (argCount != 3 || !IS_MAP(args[0]) || !IS_STRING(args[1])) {
-        runtimeError("dictSet() expects a dictionary, a string key, and a value.");
+    if (argCount != 3 || !IS_MAP(args[0])) {
+        runtimeError("dictSet() expects a dictionary, a key, and a value.");
+        return NIL_VAL;
+    }
+    // The canonical key replaces the argument so it stays rooted while the
+    // table grows.
+    if (!mapKey(&args[1], true)) {
+        runtimeError("dictSet() cannot use NaN as a key.");
         return NIL_VAL;
     }
     ObjMap* map = AS_MAP(args[0]);
-    ObjString* key = AS_STRING(args[1]);
-    tableSet(&map->table, key, args[2]);
+    mapTableSet(&map->table, args[1], args[2]);
+    WRITE_BARRIER(map);
     return NIL_VAL; // Or maybe return the value?
 }
 
 // Gets a value from a dictionary.
 Value dictGetNative(int argCount, Value* args) {
-    if (argCount != 2 || !IS_MAP(args[0]) || !IS_STRING(args[1])) {
-        runtimeError("dictGet() expects a dictionary and a string key.");
+    if (argCount != 2 || !IS_MAP(args[0])) {
+        runtimeError("dictGet() expects a dictionary and a key.");
         return NIL_VAL;
     }
     ObjMap* map = AS_MAP(args[0]);
-    ObjString* key = AS_STRING(args[1]);
+    Value key = args[1];
     Value value;
-    if (tableGet(&map->table, key, &value)) {
+    if (mapKey(&key, false) && mapTableGet(&map->table, key, &value)) {
         return value;
     }
     return NIL_VAL; // Key not found
@@ -44,23 +50,37 @@ Value dictGetNative(int argCount, Value* args) {
 
 // Deletes a key-value pair from a dictionary.
 Value dictDeleteNative(int argCount, Value* args) {
-    if (argCount != 2 || !IS_MAP(args[0]) || !IS_STRING(args[1])) {
-        runtimeError("dictDelete() expects a dictionary and a string key.");
+    if (argCount != 2 || !IS_MAP(args[0])) {
+        runtimeError("dictDelete() expects a dictionary and a key.");
         return NIL_VAL;
     }
     ObjMap* map = AS_MAP(args[0]);
-    ObjString* key = AS_STRING(args[1]);
-    return BOOL_VAL(tableDelete(&map->table, key));
+    Value key = args[1];
+    return BOOL_VAL(mapKey(&key, false) && mapTableDelete(&map->table, key));
+}
+
+// Makes room for count keys so that filling the dictionary never rehashes.
+Value dictReserveNative(int argCount, Value* args) {
+    if (argCount != 2 || !IS_MAP(args[0]) || !IS_NUMBER(args[1]) ||
+        AS_NUMBER(args[1]) < 0 || AS_NUMBER(args[1]) > INT32_MAX / 2) {
+        runtimeError("dictReserve() expects a dictionary and a non-negative count.");
+        return NIL_VAL;
+    }
+    if (!mapTableReserve(&AS_MAP(args[0])->table, (int)AS_NUMBER(args[1]))) {
+        runtimeError("Cannot reserve room for %.0f keys in a dictionary.",
+                     AS_NUMBER(args[1]));
+    }
+    return NIL_VAL;
 }
 
 // Checks if a key exists in a dictionary.
 Value dictExistsNative(int argCount, Value* args) {
-    if (argCount != 2 || !IS_MAP(args[0]) || !IS_STRING(args[1])) {
-        runtimeError("dictExists() expects a dictionary and a string key.");
+    if (argCount != 2 || !IS_MAP(args[0])) {
+        runtimeError("dictExists() expects a dictionary and a key.");
         return NIL_VAL;
     }
     ObjMap* map = AS_MAP(args[0]);
-    ObjString* key = AS_STRING(args[1]);
+    Value key = args[1];
     Value value;
-    return BOOL_VAL(tableGet(&map->table, key, &value));
+    return BOOL_VAL(mapKey(&key, false) && mapTableGet(&map->table, key, &value));
 }
@@ -6,6 +6,7 @@
 #include <ctype.h>
 
 #include "io.h"
+#include "memory.h"
 #include "value.h"
 #include "object.h"
 #include "vm.h"
@@ -112,26 +113,19 @@ Value readFileNative(int argCount, Value* args) {
     size_t fileSize = ftell(file);
     rewind(file);
 
-    char* buffer = (char*)malloc(fileSize + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        fclose(file);
-        exit(74);
-    }
+    // Read straight into the string's inline storage. File contents are
+    // neither hashed nor interned unless they are later used as a key.
+    ObjString* contents = newString((int)fileSize);
 
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    size_t bytesRead = fread(contents->chars, sizeof(char), fileSize, file);
     if (bytesRead < fileSize) {
         fprintf(stderr, "Could not read file \"%s\".\n", path);
-        free(buffer);
         fclose(file);
         exit(74);
     }
 
-    buffer[bytesRead] = '\0';
     fclose(file);
-
-    // takeString will handle freeing the buffer
-    return OBJ_VAL(takeString(buffer, bytesRead));
+    return OBJ_VAL(contents);
 }
 
 Value writeFileNative(int argCount, Value* args) {
@@ -310,7 +304,7 @@ Value substringNative(int argCount, Value* args) {
     }
 
     int length = end - start;
-    return OBJ_VAL(copyString(str->chars + start, length));
+    return OBJ_VAL(newStringCopy(str->chars + start, length));
 }
 
 Value splitNative(int argCount, Value* args) {
@@ -330,7 +324,10 @@ Value splitNative(int argCount, Value* args) {
 
     if (delim_len == 0) { // Handle empty delimiter
         // Just return the original string in a list
-        writeValueArray(list->items, OBJ_VAL(copyString(source, str->length)));
+        push(OBJ_VAL(newStringCopy(source, str->length)));
+        writeValueArray(list->items, vm.stackTop[-1]);
+        WRITE_BARRIER(list);
+        pop();
         pop();
         return OBJ_VAL(list);
     }
@@ -340,15 +337,21 @@ Value splitNative(int argCount, Value* args) {
 
     while (found != NULL) {
         int token_len = found - current;
-        Value tokenValue = OBJ_VAL(copyString(current, token_len));
+        Value tokenValue = OBJ_VAL(newStringCopy(current, token_len));
+        push(tokenValue);
         writeValueArray(list->items, tokenValue);
+        WRITE_BARRIER(list);
+        pop();
 
         current = found + delim_len;
         found = strstr(current, delim);
     }
 
     // Add the final part of the string after the last delimiter
-    writeValueArray(list->items, OBJ_VAL(copyString(current, strlen(current))));
+    push(OBJ_VAL(newStringCopy(current, strlen(current))));
+    writeValueArray(list->items, vm.stackTop[-1]);
+    WRITE_BARRIER(list);
+    pop();
 
     pop();
     return OBJ_VAL(list);